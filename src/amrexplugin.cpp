@@ -0,0 +1,499 @@
+#include "amrexplugin.h"
+
+#include "stats.h"
+#include "vdb_tools.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+// Plotfile layout, as written by amrex::WriteMultiLevelPlotfile:
+//
+//   plt00100/Header             variables, levels, geometry
+//   plt00100/Level_0/Cell_H     boxes of the level and where each FAB lives
+//   plt00100/Level_0/Cell_D_*   FABs, each an ASCII header line followed by
+//                               every component's cells, X fastest
+
+namespace {
+
+// A cell centered box of a level, in that level's index space
+struct AMRBox {
+    std::array<int, 3> lo = { 0, 0, 0 };
+    std::array<int, 3> hi = { 0, 0, 0 };
+
+    std::array<size_t, 3> dims() const {
+        return { size_t(hi[0] - lo[0] + 1),
+                 size_t(hi[1] - lo[1] + 1),
+                 size_t(hi[2] - lo[2] + 1) };
+    }
+};
+
+struct FabOnDisk {
+    AMRBox      box;
+    fs::path    file;
+    std::size_t offset;
+};
+
+struct PlotLevel {
+    std::array<double, 3>  spacing = { 1, 1, 1 };
+    std::vector<FabOnDisk> fabs;
+};
+
+struct PlotHeader {
+    std::vector<std::string> variables;
+    int                      space_dim = 3;
+    std::array<double, 3>    prob_lo   = { 0, 0, 0 };
+    std::vector<PlotLevel>   levels;
+};
+
+// Read the next integer, skipping the punctuation of AMReX box and tuple
+// syntax
+int read_int(std::istream& is) {
+    int ch;
+
+    while ((ch = is.peek()) != EOF && !std::isdigit(ch) && ch != '-') {
+        is.get();
+    }
+
+    int value = 0;
+
+    if (!(is >> value)) throw std::runtime_error("Malformed plotfile header");
+
+    return value;
+}
+
+// ((lo) (hi) (type)), with space_dim entries in each
+AMRBox read_box(std::istream& is, int space_dim) {
+    AMRBox box;
+
+    for (int i = 0; i < space_dim; i++) box.lo[i] = read_int(is);
+    for (int i = 0; i < space_dim; i++) box.hi[i] = read_int(is);
+    for (int i = 0; i < space_dim; i++) read_int(is);
+
+    return box;
+}
+
+template <class T>
+T read_value(std::istream& is) {
+    T value;
+
+    if (!(is >> value)) throw std::runtime_error("Malformed plotfile header");
+
+    return value;
+}
+
+// Boxes and FAB locations of one level, from its Cell_H
+std::vector<FabOnDisk> read_cell_header(fs::path const& path, int space_dim) {
+    std::ifstream is(path);
+
+    if (!is) throw std::runtime_error("Unable to open " + path.string());
+
+    read_value<int>(is);         // version
+    read_value<int>(is);         // how
+    read_value<int>(is);         // components
+    read_value<std::string>(is); // ghost cells, an int or an IntVect
+
+    // (count hash boxes... )
+    int const count = read_int(is);
+    read_int(is);
+
+    std::vector<FabOnDisk> fabs(count);
+
+    for (auto& fab : fabs) {
+        fab.box = read_box(is, space_dim);
+    }
+
+    if (read_int(is) != count) {
+        throw std::runtime_error("Mismatched FAB count in " + path.string());
+    }
+
+    for (auto& fab : fabs) {
+        read_value<std::string>(is); // FabOnDisk:
+
+        fab.file   = path.parent_path() / read_value<std::string>(is);
+        fab.offset = read_value<std::size_t>(is);
+    }
+
+    return fabs;
+}
+
+PlotHeader read_plot_header(fs::path const& dir) {
+    std::ifstream is(dir / "Header");
+
+    if (!is) throw std::runtime_error("Unable to open plotfile header");
+
+    PlotHeader ret;
+
+    read_value<std::string>(is); // version
+
+    ret.variables.resize(read_value<int>(is));
+
+    for (auto& name : ret.variables) {
+        name = read_value<std::string>(is);
+    }
+
+    ret.space_dim = read_value<int>(is);
+
+    if (ret.space_dim < 1 || ret.space_dim > 3) {
+        throw std::runtime_error("Unsupported plotfile dimension");
+    }
+
+    read_value<double>(is); // time
+
+    int const finest = read_value<int>(is);
+
+    for (int i = 0; i < ret.space_dim; i++) {
+        ret.prob_lo[i] = read_value<double>(is);
+    }
+
+    for (int i = 0; i < ret.space_dim; i++) read_value<double>(is); // prob_hi
+    for (int i = 0; i < finest; i++) read_value<int>(is);  // refinement ratio
+    for (int i = 0; i <= finest; i++) read_box(is, ret.space_dim); // domain
+    for (int i = 0; i <= finest; i++) read_value<int>(is); // level steps
+
+    ret.levels.resize(finest + 1);
+
+    for (auto& level : ret.levels) {
+        for (int i = 0; i < ret.space_dim; i++) {
+            level.spacing[i] = read_value<double>(is);
+        }
+    }
+
+    read_value<int>(is); // coordinate system
+    read_value<int>(is); // boundary width
+
+    for (auto& level : ret.levels) {
+        read_value<int>(is);    // level
+        int const boxes = read_value<int>(is);
+        read_value<double>(is); // time
+        read_value<int>(is);    // level step
+
+        // physical bounds of each box, also in Cell_H in index form
+        for (int i = 0; i < boxes * ret.space_dim * 2; i++) {
+            read_value<double>(is);
+        }
+
+        auto prefix = read_value<std::string>(is);
+
+        level.fabs = read_cell_header(dir / (prefix + "_H"), ret.space_dim);
+    }
+
+    return ret;
+}
+
+// The components of one FAB that are being converted, as floats
+struct FabData {
+    std::array<size_t, 3>           dims;
+    std::vector<std::vector<float>> fields;
+    size_t                          bytes_read = 0;
+};
+
+// Read the header line of a FAB and then each wanted component. The line is
+// FAB ((bytes, (format)),(bytes, (byte order)))((lo) (hi) (type)) components
+FabData read_fab(FabOnDisk const&        fab,
+                 std::vector<int> const& components,
+                 int                     space_dim) {
+    std::ifstream is(fab.file, std::ios::binary);
+
+    if (!is) throw std::runtime_error("Unable to open " + fab.file.string());
+
+    is.seekg(fab.offset);
+
+    std::string line;
+    std::getline(is, line);
+
+    auto const data_start = fab.offset + line.size() + 1;
+
+    std::istringstream header(line);
+
+    int const bytes = read_int(header); // real size
+    for (int i = 0; i < 8; i++) read_int(header);
+    read_int(header);                   // byte order size
+
+    // byte order lists the position of each byte, 1 first when big endian
+    bool const big_endian = read_int(header) == 1;
+
+    header.str(line.substr(line.find(")))") + 3));
+    header.clear();
+
+    AMRBox box = read_box(header, space_dim);
+
+    if (box.dims() != fab.box.dims()) {
+        throw std::runtime_error("FAB box mismatch in " + fab.file.string());
+    }
+
+    if (bytes != 4 && bytes != 8) {
+        throw std::runtime_error("Unsupported FAB real size");
+    }
+
+    FabData ret;
+    ret.dims = box.dims();
+
+    size_t const cells = ret.dims[0] * ret.dims[1] * ret.dims[2];
+
+    std::vector<char> raw(cells * bytes);
+
+    for (int component : components) {
+        is.seekg(data_start + component * raw.size());
+        is.read(raw.data(), raw.size());
+
+        if (!is) throw std::runtime_error("Short FAB in " + fab.file.string());
+
+        ret.bytes_read += raw.size();
+
+        if (big_endian) {
+            for (size_t i = 0; i < raw.size(); i += bytes) {
+                std::reverse(raw.data() + i, raw.data() + i + bytes);
+            }
+        }
+
+        auto& field = ret.fields.emplace_back(cells);
+
+        for (size_t i = 0; i < cells; i++) {
+            if (bytes == 8) {
+                double value;
+                std::memcpy(&value, raw.data() + i * 8, 8);
+                field[i] = value;
+            } else {
+                std::memcpy(&field[i], raw.data() + i * 4, 4);
+            }
+        }
+    }
+
+    return ret;
+}
+
+// Size of each level's cells in cells of the target level
+std::array<int, 3> level_scale(PlotHeader const& header,
+                               size_t            level,
+                               size_t            target) {
+    std::array<int, 3> ret;
+
+    for (int i = 0; i < 3; i++) {
+        ret[i] = std::max(1,
+                          int(std::lround(header.levels[level].spacing[i] /
+                                          header.levels[target].spacing[i])));
+    }
+
+    return ret;
+}
+
+// Transform placing the cell centers of a level in world space
+openvdb::math::Transform::Ptr level_transform(PlotHeader const& header,
+                                              size_t            level) {
+    auto const& spacing = header.levels[level].spacing;
+    auto const& origin  = header.prob_lo;
+
+    openvdb::Mat4d m = openvdb::Mat4d::identity();
+    m.preScale(openvdb::Vec3d(spacing[0], spacing[1], spacing[2]));
+    m.postTranslate(openvdb::Vec3d(origin[0] + spacing[0] / 2,
+                                   origin[1] + spacing[1] / 2,
+                                   origin[2] + spacing[2] / 2));
+
+    return openvdb::math::Transform::createLinearTransform(m);
+}
+
+// Build every FAB of a level, one task per FAB, and merge them into one grid
+// per field. Cells of a coarse level fill scale voxels per axis, through the
+// same box builder as the VTK AMR path.
+FloatGrids build_level(PlotHeader const&       header,
+                       size_t                  level,
+                       std::array<int, 3>      scale,
+                       std::vector<int> const& components,
+                       Config const&           c) {
+    auto const& fabs = header.levels[level].fabs;
+
+    // parts[field][fab]
+    std::vector<openvdb::GridPtrVec> parts(components.size(),
+                                           openvdb::GridPtrVec(fabs.size()));
+
+    PhaseTimer timer(c, "build");
+
+    auto build_fab = [&](size_t i) {
+        PhaseTimer fab_timer(c, "read_fab", PhaseTimer::Clock::THREAD);
+
+        auto data = read_fab(fabs[i], components, header.space_dim);
+
+        fab_timer.add_bytes_read(data.bytes_read);
+
+        size_t const field_count = components.size();
+
+        auto reader = [&](size_t x, size_t y, size_t z, float* out) {
+            size_t cell = x + data.dims[0] * (y + data.dims[1] * z);
+
+            for (size_t f = 0; f < field_count; f++) {
+                out[f] = data.fields[f][cell];
+            }
+
+            return true;
+        };
+
+        auto grids = build_box_fields(
+            fabs[i].box.lo, data.dims, scale, field_count, reader, c);
+
+        for (size_t f = 0; f < field_count; f++) {
+            parts[f][i] = grids[f];
+        }
+    };
+
+    if (c.use_threads) {
+        tbb::parallel_for(size_t(0), fabs.size(), build_fab);
+    } else {
+        for (size_t i = 0; i < fabs.size(); i++) {
+            build_fab(i);
+        }
+    }
+
+    FloatGrids ret;
+
+    for (auto const& field_parts : parts) {
+        if (field_parts.empty()) {
+            ret.push_back(openvdb::FloatGrid::create(build_background(c)));
+        } else {
+            ret.push_back(
+                merge_pairwise<openvdb::FloatGrid>(field_parts, c));
+        }
+    }
+
+    timer.add_grids(ret);
+
+    return ret;
+}
+
+} // namespace
+
+AMReXPlugin::AMReXPlugin(Config const&) { }
+
+AMReXPlugin::~AMReXPlugin() { }
+
+bool AMReXPlugin::recognized(fs::path const& path) {
+    return fs::is_directory(path) && fs::is_regular_file(path / "Header");
+}
+
+// Levels are merged finest first, so that finer cells take precedence where
+// levels overlap, in the index space of the finest level. Coarse cells are
+// then stored densely at that resolution, unless they cover whole leaves.
+// With --amr_per_level, each level is kept as its own grid with its own
+// transform, and memory follows the cell count of the plotfile.
+openvdb::GridPtrVec AMReXPlugin::convert(Config const& config) {
+    PlotHeader header;
+
+    try {
+        PhaseTimer timer(config, "read");
+        header = read_plot_header(config.input_path);
+    } catch (std::exception const& e) {
+        std::cerr << e.what() << std::endl;
+        return {};
+    }
+
+    std::vector<int>         components;
+    std::vector<std::string> names;
+
+    for (size_t i = 0; i < header.variables.size(); i++) {
+        auto iter = config.name_map.find(header.variables[i]);
+
+        if (iter == config.name_map.end()) continue;
+
+        components.push_back(i);
+        names.push_back(iter->second);
+    }
+
+    if (components.empty()) {
+        std::cerr << "No requested variables in plotfile. Available:";
+        for (auto const& name : header.variables) std::cerr << " " << name;
+        std::cerr << std::endl;
+        return {};
+    }
+
+    size_t levels = header.levels.size();
+
+    if (config.requested_amr_level) {
+        levels = std::clamp<size_t>(*config.requested_amr_level + 1, 1, levels);
+    }
+
+    size_t const finest    = levels - 1;
+    bool const   per_level = config.has_flag("--amr_per_level");
+
+    std::cout << "Levels: " << levels << std::endl;
+
+    auto build = [&](size_t level) {
+        auto scale = per_level ? std::array<int, 3> { 1, 1, 1 }
+                               : level_scale(header, level, finest);
+
+        std::cout << "Level " << level << ": "
+                  << header.levels[level].fabs.size() << " boxes" << std::endl;
+
+        return build_level(header, level, scale, components, config);
+    };
+
+    // levels[level][field] with --amr_per_level; otherwise only the merged
+    // grids of each field
+    std::vector<FloatGrids> level_grids;
+    FloatGrids              merged;
+
+    try {
+        if (per_level) {
+            for (size_t level = 0; level < levels; level++) {
+                level_grids.push_back(build(level));
+            }
+        } else {
+            if (finest > 0) print_amr_merge_note();
+
+            // finest first, merging and freeing each coarser level as soon
+            // as it is built
+            merged = build(finest);
+
+            for (size_t level = finest; level-- > 0;) {
+                auto coarse = build(level);
+
+                PhaseTimer timer(config, "merge_levels");
+
+                for (size_t f = 0; f < merged.size(); f++) {
+                    merged[f]->tree().merge(coarse[f]->tree(),
+                                            openvdb::MERGE_ACTIVE_STATES);
+                }
+            }
+        }
+    } catch (std::exception const& e) {
+        std::cerr << e.what() << std::endl;
+        return {};
+    }
+
+    openvdb::GridPtrVec ret;
+
+    auto finish = [&](openvdb::FloatGrid::Ptr grid, size_t f, size_t level) {
+        prune_grid(*grid, config);
+
+        grid->setName(names[f]);
+        grid->insertMeta("source_name",
+                         openvdb::StringMetadata(
+                             header.variables[components[f]]));
+        grid->setTransform(level_transform(header, level));
+
+        ret.push_back(grid);
+    };
+
+    for (size_t f = 0; f < components.size(); f++) {
+        if (per_level) {
+            for (size_t level = 0; level < levels; level++) {
+                auto grid = level_grids[level][f];
+
+                finish(grid, f, level);
+
+                grid->setName(names[f] + "_level" + std::to_string(level));
+                grid->insertMeta("amr_level", openvdb::Int32Metadata(level));
+            }
+
+            continue;
+        }
+
+        finish(merged[f], f, finest);
+    }
+
+    return ret;
+}
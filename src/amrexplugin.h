@@ -0,0 +1,19 @@
+#ifndef AMREXPLUGIN_H
+#define AMREXPLUGIN_H
+
+#include "common.h"
+
+#include <openvdb/openvdb.h>
+
+// Reads AMReX plotfile directories directly, without VTK
+class AMReXPlugin {
+public:
+    AMReXPlugin(Config const&);
+    ~AMReXPlugin();
+
+    static bool recognized(fs::path const&);
+
+    openvdb::GridPtrVec convert(Config const&);
+};
+
+#endif // AMREXPLUGIN_H
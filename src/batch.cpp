@@ -0,0 +1,160 @@
+#include "batch.h"
+
+#include <glob.h>
+
+#include <tbb/parallel_pipeline.h>
+
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <unordered_map>
+
+fs::path default_output_path(fs::path const& input) {
+    auto ret = input;
+
+    if (ret.extension() == ".gz" || ret.extension() == ".zst") {
+        ret.replace_extension();
+    }
+
+    return ret.replace_extension(".vdb");
+}
+
+std::vector<fs::path> collect_batch_inputs(std::string const& spec) {
+    std::vector<fs::path> ret;
+
+    if (fs::is_regular_file(spec)) {
+        std::ifstream ifs(spec);
+
+        std::string line;
+
+        while (std::getline(ifs, line)) {
+            if (line.empty() or line[0] == '#') continue;
+            ret.emplace_back(line);
+        }
+
+        return ret;
+    }
+
+    glob_t result;
+
+    if (glob(spec.c_str(), 0, nullptr, &result) == 0) {
+        for (size_t i = 0; i < result.gl_pathc; i++) {
+            ret.emplace_back(result.gl_pathv[i]);
+        }
+    }
+
+    globfree(&result);
+
+    return ret;
+}
+
+namespace {
+
+struct Frame {
+    size_t              index = 0;
+    Config              config;
+    openvdb::GridPtrVec grids;
+    bool                ok = false;
+};
+
+using FramePtr = std::shared_ptr<Frame>;
+
+} // namespace
+
+size_t run_batch(Config const&                base,
+                 std::vector<fs::path> const& inputs,
+                 ConvertFunction const&       convert,
+                 WriteFunction const&         write) {
+    // inputs differing only in a compression suffix would share an output
+    {
+        std::unordered_map<fs::path::string_type, fs::path> outputs;
+
+        for (auto const& input : inputs) {
+            auto out_dir = base.batch_output_dir.value_or(input.parent_path());
+            auto output  = out_dir / default_output_path(input.filename());
+
+            auto [iter, added] = outputs.emplace(output.native(), input);
+
+            if (!added) {
+                std::cerr << "Inputs " << iter->second << " and " << input
+                          << " would both be written to " << output << "\n";
+                return inputs.size();
+            }
+        }
+    }
+
+    size_t              next = 0;
+    std::atomic<size_t> failures { 0 };
+
+    auto const inflight = size_t(std::max(base.batch_inflight, 1));
+
+    // read and build are a single stage, as plugins do both in convert()
+    auto source = tbb::make_filter<void, FramePtr>(
+        tbb::filter_mode::serial_in_order, [&](tbb::flow_control& fc) {
+            if (next >= inputs.size()) {
+                fc.stop();
+                return FramePtr();
+            }
+
+            auto frame    = std::make_shared<Frame>();
+            frame->index  = next;
+            frame->config = base;
+
+            auto& c      = frame->config;
+            c.input_path = inputs[next];
+
+            auto out_dir = base.batch_output_dir.value_or(
+                c.input_path.parent_path());
+
+            c.output_path =
+                out_dir / default_output_path(c.input_path.filename());
+
+            next++;
+
+            return frame;
+        });
+
+    auto build = tbb::make_filter<FramePtr, FramePtr>(
+        tbb::filter_mode::parallel, [&](FramePtr frame) {
+            auto const& c = frame->config;
+
+            std::cout << "[" << frame->index + 1 << "/" << inputs.size()
+                      << "] Converting " << c.input_path << std::endl;
+
+            try {
+                frame->grids = convert(c);
+                frame->ok    = true;
+            } catch (std::exception const& e) {
+                std::cerr << "Unable to convert " << c.input_path << ": "
+                          << e.what() << "\n";
+            }
+
+            return frame;
+        });
+
+    auto sink = tbb::make_filter<FramePtr, void>(
+        tbb::filter_mode::serial_in_order, [&](FramePtr frame) {
+            auto const& c = frame->config;
+
+            if (frame->ok) {
+                try {
+                    write(c, frame->grids);
+
+                    std::cout << "[" << frame->index + 1 << "/"
+                              << inputs.size() << "] Wrote " << c.output_path
+                              << std::endl;
+                } catch (std::exception const& e) {
+                    std::cerr << "Unable to write " << c.output_path << ": "
+                              << e.what() << "\n";
+                    frame->ok = false;
+                }
+            }
+
+            if (!frame->ok) failures++;
+        });
+
+    tbb::parallel_pipeline(inflight, source & build & sink);
+
+    return failures;
+}
@@ -0,0 +1,31 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "common.h"
+
+#include <openvdb/openvdb.h>
+
+#include <functional>
+#include <vector>
+
+using ConvertFunction = std::function<openvdb::GridPtrVec(Config const&)>;
+using WriteFunction =
+    std::function<void(Config const&, openvdb::GridPtrVec const&)>;
+
+// Output path used when none is given: the input with any .gz or .zst
+// suffix removed, and its extension replaced by .vdb
+fs::path default_output_path(fs::path const& input);
+
+// Expand a batch spec into input paths. An existing file is read as a list
+// with one path per line; anything else is treated as a glob pattern.
+std::vector<fs::path> collect_batch_inputs(std::string const& spec);
+
+// Convert every input, overlapping the conversion of some frames with the
+// writing of others. At most Config::batch_inflight frames are held at once.
+// Returns the number of frames that failed.
+size_t run_batch(Config const&                base,
+                 std::vector<fs::path> const& inputs,
+                 ConvertFunction const&       convert,
+                 WriteFunction const&         write);
+
+#endif // BATCH_H
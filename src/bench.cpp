@@ -0,0 +1,526 @@
+#include "binary_source.h"
+#include "common.h"
+#include "vdb_tools.h"
+#include "vdb_writer.h"
+
+#include <cxxopts.hpp>
+
+#include <openvdb/openvdb.h>
+
+#include <tbb/global_control.h>
+#include <tbb/parallel_for.h>
+
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <vector>
+
+// Benchmarks for the VDB build. Each case prints one line with its timing.
+// Synthetic volumes are generated in memory and timed stage by stage from
+// both an in-memory (MemData) and a mapped (MapData) source.
+
+template <class Function>
+double time_it(Function&& f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+    return d.count();
+}
+
+char const* order_name(MemoryOrder order) {
+    return order == MemoryOrder::C ? "C" : "F";
+}
+
+char const* engine_name(BuildEngine engine) {
+    return engine == BuildEngine::LEAF ? "leaf" : "accessor";
+}
+
+// Write a dense size^3 float volume in the given order, one plane at a time.
+fs::path write_volume(fs::path const& dir, size_t size, MemoryOrder order) {
+    auto path = dir / (std::string("bench_") + order_name(order) + ".bin");
+
+    std::ofstream ofs(path, std::ios::out | std::ios::binary);
+
+    if (!ofs.good()) throw std::runtime_error("Unable to write volume");
+
+    std::vector<float> plane(size * size);
+
+    for (size_t i = 0; i < size; i++) {
+        for (size_t j = 0; j < size; j++) {
+            for (size_t k = 0; k < size; k++) {
+                // plane i along the slowest axis, k fastest
+                plane[j * size + k] =
+                    1.0f + std::sin(0.1f * i) * std::cos(0.05f * j) +
+                    0.01f * k;
+            }
+        }
+
+        ofs.write(reinterpret_cast<char const*>(plane.data()),
+                  plane.size() * sizeof(float));
+    }
+
+    if (!ofs) throw std::runtime_error("Unable to write volume");
+
+    return path;
+}
+
+enum class Shape {
+    // dense hashed noise in [0, 1)
+    NOISE,
+    // a spherical shell one twentieth of the size thick, zero elsewhere
+    SHELL,
+    // a few gaussian blobs in an otherwise empty volume
+    CLUSTERS,
+    // an elongated ellipsoid in a flattened volume of size x size/2 x size/8
+    ANISOTROPIC,
+};
+
+struct Volume {
+    std::array<size_t, 3>    dims;
+    std::unique_ptr<MemData> mem;
+};
+
+float hash_noise(size_t x, size_t y, size_t z) {
+    uint64_t h = x * 0x9E3779B97F4A7C15ull ^ y * 0xC2B2AE3D27D4EB4Full ^
+                 z * 0x165667B19E3779F9ull;
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ull;
+    h ^= h >> 32;
+    return (h >> 40) * (1.0f / (1 << 24));
+}
+
+// Generate a synthetic volume in memory, in C order
+Volume generate(Shape shape, size_t size) {
+    Volume ret;
+
+    ret.dims = { size, size, size };
+
+    if (shape == Shape::ANISOTROPIC) {
+        ret.dims = { size, std::max<size_t>(size / 2, 1),
+                     std::max<size_t>(size / 8, 1) };
+    }
+
+    auto const dims  = ret.dims;
+    size_t     count = dims[0] * dims[1] * dims[2];
+
+    ret.mem             = std::make_unique<MemData>();
+    ret.mem->data       = std::make_unique<std::byte[]>(count * sizeof(float));
+    ret.mem->byte_count = count * sizeof(float);
+
+    auto* out = reinterpret_cast<float*>(ret.mem->data.get());
+
+    std::array<std::array<float, 3>, 8> centers;
+
+    for (size_t i = 0; i < centers.size(); i++) {
+        for (size_t axis = 0; axis < 3; axis++) {
+            centers[i][axis] = (0.1f + 0.8f * hash_noise(i, axis, 7)) * size;
+        }
+    }
+
+    float const half   = size / 2.0f;
+    float const radius = size / 16.0f;
+
+    auto value = [&](size_t x, size_t y, size_t z) -> float {
+        float fx = x, fy = y, fz = z;
+
+        switch (shape) {
+        case Shape::NOISE: return hash_noise(x, y, z);
+        case Shape::SHELL: {
+            float r = std::sqrt((fx - half) * (fx - half) +
+                                (fy - half) * (fy - half) +
+                                (fz - half) * (fz - half));
+            return std::abs(r - size * 0.4f) < size / 40.0f ? 1.0f : 0.0f;
+        }
+        case Shape::CLUSTERS: {
+            float sum = 0;
+            for (auto const& p : centers) {
+                float d2 = (fx - p[0]) * (fx - p[0]) +
+                           (fy - p[1]) * (fy - p[1]) +
+                           (fz - p[2]) * (fz - p[2]);
+                if (d2 < 4 * radius * radius) {
+                    sum += std::exp(-d2 / (radius * radius));
+                }
+            }
+            return sum;
+        }
+        case Shape::ANISOTROPIC: {
+            float u = (fx - dims[0] / 2.0f) / (dims[0] * 0.45f);
+            float v = (fy - dims[1] / 2.0f) / (dims[1] * 0.2f);
+            float w = (fz - dims[2] / 2.0f) / (dims[2] * 0.4f);
+            return u * u + v * v + w * w < 1 ? 1.0f : 0.0f;
+        }
+        }
+        return 0;
+    };
+
+    tbb::parallel_for(size_t(0), dims[0], [&](size_t x) {
+        for (size_t y = 0; y < dims[1]; y++) {
+            for (size_t z = 0; z < dims[2]; z++) {
+                out[compute_index<MemoryOrder::C>(x, y, z, dims)] =
+                    value(x, y, z);
+            }
+        }
+    });
+
+    return ret;
+}
+
+// Build from a mapped file with every combination of storage order,
+// traversal order and engine. A mismatched traversal strides through the
+// mapping on every inner-loop read.
+void bench_order(Config const& c, fs::path const& dir, size_t size) {
+    std::array<size_t, 3> dims = { size, size, size };
+
+    for (auto storage : { MemoryOrder::C, MemoryOrder::F }) {
+        auto path = write_volume(dir, size, storage);
+
+        for (auto traversal : { MemoryOrder::C, MemoryOrder::F }) {
+            for (auto engine : { BuildEngine::ACCESSOR, BuildEngine::LEAF }) {
+                Config run_config = c;
+                run_config.engine = engine;
+
+                // fresh mapping per case so each pays the same page faults
+                auto map = map_file_to(path);
+
+                if (!map) throw std::runtime_error("Unable to map volume");
+
+                auto data = reinterpret_cast<float const*>(map->begin());
+
+                double seconds = dispatch_order(storage, [&](auto tag) {
+                    constexpr MemoryOrder O = decltype(tag)::value;
+
+                    auto reader = [=](size_t x, size_t y, size_t z) -> float {
+                        return data[compute_index<O>(x, y, z, dims)];
+                    };
+
+                    return time_it([&]() {
+                        auto grid =
+                            build_open_vdb(dims, reader, run_config, traversal);
+                    });
+                });
+
+                std::cout << "order size=" << size
+                          << " storage=" << order_name(storage)
+                          << " traversal=" << order_name(traversal)
+                          << " engine=" << engine_name(engine) << ": "
+                          << seconds << " s" << std::endl;
+            }
+        }
+
+        fs::remove(path);
+    }
+}
+
+char const* shape_name(Shape shape) {
+    switch (shape) {
+    case Shape::NOISE: return "noise";
+    case Shape::SHELL: return "shell";
+    case Shape::CLUSTERS: return "clusters";
+    case Shape::ANISOTROPIC: return "anisotropic";
+    }
+    return "";
+}
+
+// Read a file back with io::File and check it holds the float grids written,
+// in order, with the same names, transforms and active values
+void check_readback(fs::path const& path, openvdb::GridPtrVec const& grids) {
+    openvdb::io::File file(path.string());
+    file.open();
+
+    auto read = file.getGrids();
+
+    file.close();
+
+    auto fail = [&](std::string const& what) {
+        throw std::runtime_error("Read back of " + path.string() + ": " + what);
+    };
+
+    if (read->size() != grids.size()) fail("grid count differs");
+
+    for (size_t i = 0; i < grids.size(); i++) {
+        auto a = openvdb::gridConstPtrCast<openvdb::FloatGrid>(grids[i]);
+        auto b = openvdb::gridConstPtrCast<openvdb::FloatGrid>((*read)[i]);
+
+        if (!a || !b) fail("not a float grid");
+
+        if (a->getName() != b->getName()) fail("name differs");
+
+        if (a->transform() != b->transform()) fail("transform differs");
+
+        if (a->activeVoxelCount() != b->activeVoxelCount()) {
+            fail("active voxel count differs");
+        }
+
+        auto accessor = b->getConstAccessor();
+
+        for (auto iter = a->cbeginValueOn(); iter; ++iter) {
+            auto ijk = iter.getCoord();
+
+            if (!accessor.isValueOn(ijk) || accessor.getValue(ijk) != *iter) {
+                fail("values differ");
+            }
+        }
+    }
+}
+
+// Time each build stage on one source. The source holds floats in C order.
+template <class Source>
+void bench_source(Config const&      c,
+                  Volume const&      volume,
+                  Source const&      source,
+                  std::string const& label,
+                  fs::path const&    dir) {
+    auto const dims = volume.dims;
+    auto const data = reinterpret_cast<float const*>(source.begin());
+
+    auto reader = [=](size_t x, size_t y, size_t z) -> float {
+        return data[compute_index<MemoryOrder::C>(x, y, z, dims)];
+    };
+
+    auto report = [&](char const* stage, double seconds) {
+        std::cout << stage << " " << label << ": " << seconds << " s"
+                  << std::endl;
+    };
+
+    // one chunk of at most a tile, through the configured engine
+    {
+        auto fields = as_fields(reader);
+
+        size_t const tile = TileLayout::TILE_DIM;
+
+        Pair<size_t> xs = { 0, std::min(dims[0], tile) };
+        Pair<size_t> ys = { 0, std::min(dims[1], tile) };
+        Pair<size_t> zs = { 0, std::min(dims[2], tile) };
+
+        report("chunk", time_it([&]() {
+                   auto grids = vdb_chunk_with(
+                       fields, 1, c, xs, ys, zs, MemoryOrder::C);
+               }));
+    }
+
+    openvdb::FloatGrid::Ptr grid;
+
+    report("build", time_it([&]() {
+               grid = build_open_vdb_region(
+                   { 0, 0, 0 }, dims, reader, c, MemoryOrder::C);
+           }));
+
+    // the same build with progress reporting, to check its overhead
+    {
+        Config progress_config                  = c;
+        progress_config.all_flags["--progress"] = "1";
+
+        report("build_progress", time_it([&]() {
+                   auto progress_grid = build_open_vdb_region({ 0, 0, 0 },
+                                                              dims,
+                                                              reader,
+                                                              progress_config,
+                                                              MemoryOrder::C);
+               }));
+    }
+
+    // grafting the tile nodes of a build into one tree, as the build does
+    {
+        TileLayout   layout({ 0, 0, 0 }, dims);
+        size_t const block  = tile_block_dim(layout, c);
+        auto         fields = as_fields(reader);
+
+        std::vector<TileResult> tiles(layout.tile_count());
+
+        tbb::parallel_for(size_t(0), tiles.size(), [&](size_t t) {
+            auto results =
+                build_tile(layout, t, fields, 1, c, MemoryOrder::C, block);
+            tiles[t] = std::move(results.front());
+        });
+
+        report("graft", time_it([&]() {
+                   auto grafted = graft_tiles(layout, tiles, c);
+               }));
+    }
+
+    {
+        Config prune_config       = c;
+        prune_config.prune_amount = 0;
+
+        report("prune", time_it([&]() { prune_grid(*grid, prune_config); }));
+    }
+
+    {
+        auto path = dir / "bench.vdb";
+
+        report("write", time_it([&]() {
+                   write_vdb(path,
+                             { grid },
+                             openvdb::io::Archive::DEFAULT_COMPRESSION_FLAGS,
+                             c.use_threads);
+               }));
+
+        fs::remove(path);
+    }
+
+    // several grids go through the parallel split writer; check that the
+    // assembled file reads back as written
+    {
+        auto path = dir / "bench_split.vdb";
+
+        openvdb::GridPtrVec grids;
+
+        for (int i = 0; i < 3; i++) {
+            auto copy = grid->deepCopy();
+            copy->setName("grid_" + std::to_string(i));
+
+            for (auto iter = copy->tree().beginValueOn(); iter; ++iter) {
+                iter.setValue(*iter + float(i));
+            }
+
+            grids.push_back(copy);
+        }
+
+        bool split = false;
+
+        report("write_split", time_it([&]() {
+                   split = write_vdb_split(
+                       path,
+                       grids,
+                       openvdb::io::Archive::DEFAULT_COMPRESSION_FLAGS);
+               }));
+
+        if (!split) throw std::runtime_error("Split write was not possible");
+
+        check_readback(path, grids);
+
+        fs::remove(path);
+    }
+}
+
+// Run the stage benchmarks for every shape, size, thread count and source
+void bench_shapes(Config const&              c,
+                  fs::path const&            dir,
+                  std::vector<size_t> const& sizes,
+                  std::vector<int> const&    thread_counts) {
+    for (auto size : sizes) {
+        for (auto shape : { Shape::NOISE,
+                            Shape::SHELL,
+                            Shape::CLUSTERS,
+                            Shape::ANISOTROPIC }) {
+            auto volume = generate(shape, size);
+
+            auto path = dir / "bench_shape.bin";
+
+            {
+                std::ofstream ofs(path, std::ios::out | std::ios::binary);
+                ofs.write(reinterpret_cast<char const*>(volume.mem->begin()),
+                          volume.mem->byte_count);
+
+                if (!ofs) throw std::runtime_error("Unable to write volume");
+            }
+
+            for (auto threads : thread_counts) {
+                // 0: no limit
+                std::optional<tbb::global_control> limit;
+
+                if (threads > 0) {
+                    limit.emplace(
+                        tbb::global_control::max_allowed_parallelism,
+                        threads);
+                }
+
+                Config run_config      = c;
+                run_config.use_threads = threads != 1;
+
+                // sparse shapes get a sparse build around their background
+                if (shape == Shape::SHELL || shape == Shape::CLUSTERS) {
+                    run_config.sparse_background = 0;
+                }
+
+                std::string label = "size=" + std::to_string(size) +
+                                    " shape=" + shape_name(shape) +
+                                    " threads=" + std::to_string(threads);
+
+                bench_source(run_config,
+                             volume,
+                             *volume.mem,
+                             label + " source=mem",
+                             dir);
+
+                auto map = map_file_to(path);
+
+                if (!map) throw std::runtime_error("Unable to map volume");
+
+                bench_source(
+                    run_config, volume, *map, label + " source=map", dir);
+            }
+
+            fs::remove(path);
+        }
+    }
+}
+
+template <class T>
+std::vector<T> parse_list(std::string const& list) {
+    std::vector<T> ret;
+
+    std::istringstream is(list);
+    std::string        item;
+
+    while (std::getline(is, item, ',')) {
+        if (!item.empty()) ret.push_back(T(std::stoll(item)));
+    }
+
+    return ret;
+}
+
+int main(int argc, char* argv[]) {
+    openvdb::initialize();
+
+    cxxopts::Options options("make_openvdb_bench",
+                             "Benchmarks for make_openvdb");
+
+    // clang-format off
+    options.add_options()
+            ("sizes",
+             "Comma separated edge lengths of generated volumes",
+             cxxopts::value<std::string>()->default_value("128,256,512"))
+            ("dir",
+             "Directory for generated files",
+             cxxopts::value<std::string>()->default_value(
+                 fs::temp_directory_path().string()))
+            ("threads",
+             "Comma separated thread counts; 1 is serial, 0 is unlimited",
+             cxxopts::value<std::string>()->default_value("1,0"))
+            ("engine",
+             "VDB build engine: accessor or leaf",
+             cxxopts::value<std::string>()->default_value("accessor"))
+            ("order_sizes",
+             "Comma separated edge lengths at which to time every storage "
+             "and traversal order pairing; empty to skip",
+             cxxopts::value<std::string>()->default_value("1024"))
+            ;
+    // clang-format on
+
+    auto result = options.parse(argc, argv);
+
+    Config config;
+
+    if (result["engine"].as<std::string>() == "leaf") {
+        config.engine = BuildEngine::LEAF;
+    }
+
+    auto sizes   = parse_list<size_t>(result["sizes"].as<std::string>());
+    auto threads = parse_list<int>(result["threads"].as<std::string>());
+    auto dir     = fs::path(result["dir"].as<std::string>());
+
+    bench_shapes(config, dir, sizes, threads);
+
+    auto order_sizes =
+        parse_list<size_t>(result["order_sizes"].as<std::string>());
+
+    for (auto size : order_sizes) {
+        bench_order(config, dir, size);
+    }
+
+    return 0;
+}
@@ -0,0 +1,169 @@
+#ifndef BINARY_SOURCE_H
+#define BINARY_SOURCE_H
+
+#include "common.h"
+#include "convert_row.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+// Raw volume data, either read into memory or mapped from a file.
+
+struct MemData {
+    std::unique_ptr<std::byte[]> data;
+    std::size_t                  byte_count;
+
+    std::byte const* begin() const { return data.get(); }
+};
+
+struct MapData {
+    int fd = -1;
+
+    std::byte const* data;
+    size_t           byte_count;
+
+    ~MapData() {
+        if (fd >= 0) {
+            munmap((void*)(data), byte_count);
+            close(fd);
+        }
+    }
+
+    std::byte const* begin() const { return data; }
+};
+
+struct FileHandle {
+    int fd = -1;
+
+    FileHandle()                  = default;
+    FileHandle(FileHandle const&) = delete;
+    FileHandle& operator=(FileHandle const&) = delete;
+
+    ~FileHandle() {
+        if (fd >= 0) close(fd);
+    }
+};
+
+std::unique_ptr<MemData> read_file_into(fs::path const& file, Config const& c);
+
+std::unique_ptr<MapData> map_file_to(fs::path const& file);
+
+// pread until count bytes have arrived
+bool pread_all(int fd, std::byte* dst, size_t count, size_t offset);
+
+// Element index of a voxel in a dense volume stored in the given order
+template <MemoryOrder O>
+inline size_t
+compute_index(size_t x, size_t y, size_t z, std::array<size_t, 3> const& dims) {
+    if constexpr (O == MemoryOrder::C) {
+        return z + dims[2] * (y + dims[1] * x);
+    } else {
+        return x + dims[0] * (y + dims[1] * z);
+    }
+}
+
+// Elements between neighbouring voxels along an axis
+template <MemoryOrder O>
+inline size_t axis_step(size_t axis, std::array<size_t, 3> const& dims) {
+    if constexpr (O == MemoryOrder::C) {
+        if (axis == 2) return 1;
+        if (axis == 1) return dims[2];
+        return dims[1] * dims[2];
+    } else {
+        if (axis == 0) return 1;
+        if (axis == 1) return dims[0];
+        return dims[0] * dims[1];
+    }
+}
+
+// The axis that varies slowest in memory. A run of planes along it is one
+// contiguous range of bytes.
+inline size_t slowest_axis(MemoryOrder order) {
+    return order == MemoryOrder::C ? 0 : 2;
+}
+
+template <MemoryOrder O>
+using OrderTag = std::integral_constant<MemoryOrder, O>;
+
+// Call the function with an OrderTag, so the order is a compile time constant
+// inside per-voxel code.
+template <class Function>
+decltype(auto) dispatch_order(MemoryOrder order, Function&& f) {
+    if (order == MemoryOrder::C) return f(OrderTag<MemoryOrder::C> {});
+    return f(OrderTag<MemoryOrder::F> {});
+}
+
+// Element type of a binary file; the held value is only used as a type tag
+using ElementType = std::variant<float,
+                                 double,
+                                 int8_t,
+                                 uint8_t,
+                                 int16_t,
+                                 uint16_t,
+                                 int32_t,
+                                 HalfBits>;
+
+// Reader over every field at once. bases[f] points at the first value of
+// field f, and index_offset is the element index the data starts at. Values
+// are mapped to float(v) * scale + offset.
+template <class T, MemoryOrder O>
+struct FieldReader {
+    std::array<size_t, 3> dims;
+    std::vector<T const*> bases;
+    size_t                stride;
+    size_t                index_offset = 0;
+    float                 scale        = 1;
+    float                 offset       = 0;
+
+    size_t element(size_t x, size_t y, size_t z) const {
+        return (compute_index<O>(x, y, z, dims) - index_offset) * stride;
+    }
+
+    bool operator()(size_t x, size_t y, size_t z, float* out) const {
+        auto index = element(x, y, z);
+
+        for (size_t f = 0; f < bases.size(); f++) {
+            out[f] = float(bases[f][index]) * scale + offset;
+        }
+
+        return true;
+    }
+
+    void read_row(size_t x,
+                  size_t y,
+                  size_t z,
+                  size_t axis,
+                  size_t count,
+                  float* out) const {
+        auto index = element(x, y, z);
+        auto step  = axis_step<O>(axis, dims) * stride;
+
+        for (size_t f = 0; f < bases.size(); f++) {
+            convert_row(
+                bases[f] + index, step, count, out + f * count, scale, offset);
+        }
+    }
+};
+
+template <class T, MemoryOrder O>
+FieldReader<T, O> make_field_reader(std::array<size_t, 3> dims,
+                                    std::vector<T const*> bases,
+                                    size_t                stride,
+                                    Config const&         c,
+                                    size_t                index_offset = 0) {
+    return { dims,
+             std::move(bases),
+             stride,
+             index_offset,
+             c.bin_scale,
+             c.bin_offset };
+}
+
+#endif // BINARY_SOURCE_H
@@ -1,13 +1,23 @@
 #include "binaryplugin.h"
 
+#include "binary_source.h"
+#include "convert_row.h"
+#include "threading.h"
 #include "vdb_tools.h"
 
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#include <zlib.h>
+#include <zstd.h>
 
+#include <cerrno>
+#include <climits>
 #include <charconv>
 #include <fstream>
+#include <future>
+#include <unordered_map>
+#include <variant>
 
 // cant use span due to no support < gcc 10
 // laziness abounds in this code...
@@ -16,8 +26,31 @@ BinaryPlugin::BinaryPlugin(Config const&) { }
 
 BinaryPlugin::~BinaryPlugin() { }
 
-bool BinaryPlugin::recognized(fs::path const& exts) {
-    if (exts == ".bin") { return true; }
+// Compression of a binary input, from its outer extension
+enum class Compression { NONE, GZIP, ZSTD };
+
+Compression compression_of(fs::path const& file) {
+    auto ext = file.extension();
+
+    if (ext == ".gz") return Compression::GZIP;
+    if (ext == ".zst") return Compression::ZSTD;
+    return Compression::NONE;
+}
+
+// Extension of a binary input, including any compression suffix: .bin,
+// .bin.gz or .bin.zst
+std::string binary_extension(fs::path const& file) {
+    if (compression_of(file) == Compression::NONE) {
+        return file.extension().string();
+    }
+
+    return file.stem().extension().string() + file.extension().string();
+}
+
+bool BinaryPlugin::recognized(fs::path const& path) {
+    auto ext = binary_extension(path);
+
+    if (ext == ".bin" || ext == ".bin.gz" || ext == ".bin.zst") { return true; }
     return false;
 }
 
@@ -77,30 +110,36 @@ std::optional<std::array<size_t, 3>> get_dims(Config const& c) {
     return ret;
 }
 
-struct MemData {
-    std::unique_ptr<std::byte[]> data;
-    std::size_t                  byte_count;
+std::optional<ElementType> get_type(Config const& c) {
+    std::string type = c.bin_type.value_or("float32");
 
-    std::byte const* begin() const { return data.get(); }
-};
+    if (c.has_flag("--bin_double")) type = "float64";
 
-struct MapData {
-    int fd = -1;
+    static std::unordered_map<std::string, ElementType> const types = {
+        { "float32", float() },   { "float", float() },
+        { "float64", double() },  { "double", double() },
+        { "int8", int8_t() },     { "uint8", uint8_t() },
+        { "int16", int16_t() },   { "uint16", uint16_t() },
+        { "int32", int32_t() },   { "float16", HalfBits() },
+        { "half", HalfBits() },
+    };
 
-    std::byte const* data;
-    size_t           byte_count;
+    auto iter = types.find(type);
 
-    ~MapData() {
-        if (fd >= 0) {
-            munmap((void*)(data), byte_count);
-            close(fd);
-        }
+    if (iter == types.end()) {
+        std::cerr << "Unknown binary element type " << type << ".\n";
+        return std::nullopt;
     }
 
-    std::byte const* begin() const { return data; }
-};
+    if (type != "float32" && type != "float") {
+        std::cout << "Using element type: " << type << std::endl;
+    }
+
+    return iter->second;
+}
 
-std::unique_ptr<MemData> read_file_into(fs::path const& file) {
+std::unique_ptr<MemData> read_file_into(fs::path const& file,
+                                        Config const&   c) {
 
     if (!fs::is_regular_file(file)) return nullptr;
 
@@ -112,7 +151,11 @@ std::unique_ptr<MemData> read_file_into(fs::path const& file) {
 
     auto ret = std::make_unique<MemData>();
 
-    ret->data = std::make_unique<std::byte[]>(file_size);
+    // left uninitialized, so the pages are first touched by the read or by
+    // the workers
+    ret->data = std::unique_ptr<std::byte[]>(new std::byte[file_size]);
+
+    first_touch(ret->data.get(), file_size, c);
 
     ifs.read(reinterpret_cast<char*>(ret->data.get()), file_size);
 
@@ -140,7 +183,7 @@ std::unique_ptr<MapData> map_file_to(fs::path const& file) {
     void* ptr =
         mmap(nullptr, file_size, PROT_READ, MAP_FILE | MAP_PRIVATE, fd, 0);
 
-    if (!ptr) {
+    if (ptr == MAP_FAILED) {
         close(fd);
         return nullptr;
     }
@@ -153,65 +196,540 @@ std::unique_ptr<MapData> map_file_to(fs::path const& file) {
     return ret;
 }
 
-inline size_t
-compute_index(size_t x, size_t y, size_t z, std::array<size_t, 3> const& dims) {
-    // return x + dims[0] * (y + dims[1] * z);
-    return z + dims[2] * (y + dims[1] * x);
+bool pread_all(int fd, std::byte* dst, size_t count, size_t offset) {
+    while (count > 0) {
+        auto got = pread(fd, dst, count, offset);
+
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return false;
+
+        dst += got;
+        count -= got;
+        offset += got;
+    }
+    return true;
 }
 
-template <class T, class S>
-auto consume_mapping(std::array<size_t, 3> dims,
-                     S const&              source,
-                     std::string           name,
-                     Config const&         c) {
+std::string remap_name(std::string name, Config const& c) {
+    auto iter = c.name_map.find(name);
 
-    auto src_ptr    = source.begin();
-    auto byte_count = source.byte_count;
+    if (iter != c.name_map.end()) return iter->second;
 
-    size_t element_count = byte_count / sizeof(T);
-    auto   data          = reinterpret_cast<T const*>(src_ptr);
+    return name;
+}
 
-    auto handler = [=](size_t x, size_t y, size_t z) -> float {
-        auto index = compute_index(x, y, z, dims);
+// How the fields of a binary input are spread over files: either one file
+// with all fields interleaved per voxel, or one file per field.
+struct BinaryLayout {
+    std::vector<fs::path>    files;
+    std::vector<std::string> names;
 
-        assert(index < element_count);
+    size_t field_count() const { return names.size(); }
 
-        return float(data[index]);
-    };
+    // values per voxel in each file
+    size_t stride() const { return files.size() == 1 ? names.size() : 1; }
 
-    auto grid = build_open_vdb(dims, handler, c);
+    size_t file_of(size_t field) const {
+        return files.size() == 1 ? 0 : field;
+    }
 
-    grid->setName(name);
+    size_t component_of(size_t field) const {
+        return files.size() == 1 ? field : 0;
+    }
+};
+
+// Without --bin_fields the input holds one field, named after the file.
+// Otherwise fields are interleaved in the input or, with --bin_layout files,
+// each lives in a sibling file named after the field.
+BinaryLayout get_layout(Config const& c) {
+    BinaryLayout ret;
+
+    auto const ext = binary_extension(c.input_path);
+
+    if (!c.bin_fields) {
+        auto name = c.input_path.filename().string();
+        name.resize(name.size() - ext.size());
+
+        ret.files.push_back(c.input_path);
+        ret.names.push_back(remap_name(name, c));
+        return ret;
+    }
+
+    std::vector<std::string_view> splits;
+
+    split_ref_into(c.bin_fields.value(), ",", splits);
+
+    for (auto field : splits) {
+        if (field.empty()) continue;
+
+        auto name = std::string(field);
+
+        if (c.bin_field_files) {
+            ret.files.push_back(c.input_path.parent_path() / (name + ext));
+        }
+
+        ret.names.push_back(remap_name(name, c));
+    }
 
-    return grid;
+    if (!c.bin_field_files) ret.files.push_back(c.input_path);
+
+    return ret;
 }
 
-template <class S>
-auto process_with(std::array<size_t, 3> dims,
-                  S const&              source,
-                  std::string           name,
-                  Config const&         c,
-                  bool                  is_double) {
-    if (is_double) {
-        return consume_mapping<double>(dims, source, name, c);
-    } else {
-        return consume_mapping<float>(dims, source, name, c);
+template <class T>
+std::vector<T const*> field_bases(BinaryLayout const&                layout,
+                                  std::vector<std::byte const*> const& data) {
+    std::vector<T const*> ret;
+
+    for (size_t f = 0; f < layout.field_count(); f++) {
+        ret.push_back(reinterpret_cast<T const*>(data[layout.file_of(f)]) +
+                      layout.component_of(f));
+    }
+
+    return ret;
+}
+
+void name_grids(FloatGrids& grids, BinaryLayout const& layout) {
+    for (size_t f = 0; f < grids.size(); f++) {
+        grids[f]->setName(layout.names[f]);
     }
 }
 
-template <class F>
-auto convert_binary(std::array<size_t, 3> dims,
-                    std::string           name,
-                    Config const&         c,
-                    bool                  is_double,
-                    F&&                   handler) {
+template <class T, class F>
+FloatGrids convert_binary(BinaryLayout const&   layout,
+                          std::array<size_t, 3> dims,
+                          Config const&         c,
+                          F&&                   handler) {
+    size_t const needed =
+        dims[0] * dims[1] * dims[2] * layout.stride() * sizeof(T);
+
+    using Source = typename std::invoke_result_t<F, fs::path>::element_type;
+
+    std::vector<std::unique_ptr<Source>> sources;
+    std::vector<std::byte const*>        data;
+
+    {
+        PhaseTimer timer(c, "read");
+
+        for (auto const& file : layout.files) {
+            std::cout << "Reading file " << file << std::endl;
+
+            auto r = handler(file);
+
+            if (!r) throw std::runtime_error("Unable to read file");
+
+            if (r->byte_count < needed) {
+                throw std::runtime_error(
+                    "File is smaller than the given dimensions");
+            }
+
+            timer.add_bytes_read(needed);
+
+            data.push_back(r->begin());
+            sources.push_back(std::move(r));
+        }
+    }
+
+    auto bases = field_bases<T>(layout, data);
+
+    auto grids = dispatch_order(c.bin_order, [&](auto tag) {
+        constexpr MemoryOrder order = decltype(tag)::value;
+
+        auto reader =
+            make_field_reader<T, order>(dims, bases, layout.stride(), c);
+
+        return build_open_vdb_fields(
+            dims, layout.field_count(), reader, c, order);
+    });
+
+    name_grids(grids, layout);
+
+    return grids;
+}
+
+// Reads the slabs of one input file. Uncompressed files are read with pread,
+// compressed ones are decompressed with zlib or zstd as they are read, which
+// only allows reading the slabs in order.
+class SlabSource {
+    FileHandle  m_file;
+    Compression m_compression;
+
+    // compressed bytes read from the file, of which [m_input_pos,
+    // m_input_end) are not yet decompressed
+    std::vector<std::byte> m_input;
+    size_t                 m_input_pos   = 0;
+    size_t                 m_input_end   = 0;
+    size_t                 m_file_offset = 0;
+
+    z_stream      m_zlib = {};
+    ZSTD_DStream* m_zstd = nullptr;
+
+    // decompressed bytes consumed so far
+    size_t m_position = 0;
+
+    static constexpr size_t INPUT_BYTES = size_t(1) << 20;
+
+    bool refill() {
+        ssize_t got;
+
+        do {
+            got = pread(
+                m_file.fd, m_input.data(), m_input.size(), m_file_offset);
+        } while (got < 0 && errno == EINTR);
+
+        if (got <= 0) return false;
+
+        m_file_offset += got;
+        m_input_pos = 0;
+        m_input_end = got;
+
+        return true;
+    }
+
+    // decompress the next count bytes into dst
+    bool decompress(std::byte* dst, size_t count) {
+        while (count > 0) {
+            if (m_input_pos == m_input_end && !refill()) return false;
+
+            size_t const avail = m_input_end - m_input_pos;
+
+            size_t used = 0;
+            size_t made = 0;
+
+            if (m_compression == Compression::GZIP) {
+                size_t const chunk = std::min<size_t>(count, UINT_MAX);
+
+                m_zlib.next_in   = reinterpret_cast<Bytef*>(m_input.data() +
+                                                          m_input_pos);
+                m_zlib.avail_in  = uInt(avail);
+                m_zlib.next_out  = reinterpret_cast<Bytef*>(dst);
+                m_zlib.avail_out = uInt(chunk);
+
+                int status = inflate(&m_zlib, Z_NO_FLUSH);
+
+                if (status != Z_OK && status != Z_STREAM_END) return false;
+
+                used = avail - m_zlib.avail_in;
+                made = chunk - m_zlib.avail_out;
+
+                // concatenated gzip members continue the data
+                if (status == Z_STREAM_END && inflateReset(&m_zlib) != Z_OK) {
+                    return false;
+                }
+            } else {
+                ZSTD_inBuffer  in  = { m_input.data() + m_input_pos, avail, 0 };
+                ZSTD_outBuffer out = { dst, count, 0 };
+
+                if (ZSTD_isError(ZSTD_decompressStream(m_zstd, &out, &in))) {
+                    return false;
+                }
+
+                used = in.pos;
+                made = out.pos;
+            }
+
+            m_input_pos += used;
+            dst += made;
+            count -= made;
+        }
+
+        return true;
+    }
+
+public:
+    explicit SlabSource(fs::path const& file)
+        : m_compression(compression_of(file)) {
+        m_file.fd = open(file.c_str(), O_RDONLY);
+
+        if (m_file.fd < 0) throw std::runtime_error("Unable to open file");
+
+        if (m_compression == Compression::NONE) return;
+
+        m_input.resize(INPUT_BYTES);
+
+        if (m_compression == Compression::GZIP) {
+            // window bits plus 32 reads gzip and zlib headers
+            if (inflateInit2(&m_zlib, 15 + 32) != Z_OK) {
+                throw std::runtime_error("Unable to start decompression");
+            }
+        } else {
+            m_zstd = ZSTD_createDStream();
 
-    std::cout << "Reading file" << std::endl;
-    auto r = handler(c.input_path);
+            if (!m_zstd) {
+                throw std::runtime_error("Unable to start decompression");
+            }
+        }
+    }
+
+    SlabSource(SlabSource const&) = delete;
+    SlabSource& operator=(SlabSource const&) = delete;
+
+    ~SlabSource() {
+        if (m_compression == Compression::GZIP) inflateEnd(&m_zlib);
+        if (m_zstd) ZSTD_freeDStream(m_zstd);
+    }
+
+    bool compressed() const { return m_compression != Compression::NONE; }
+
+    // compressed files can only move forward, decompressing and dropping
+    // the bytes up to offset
+    bool read(std::byte* dst, size_t count, size_t offset) {
+        if (!compressed()) return pread_all(m_file.fd, dst, count, offset);
+
+        if (offset < m_position) return false;
+
+        std::vector<std::byte> dropped;
+
+        while (m_position < offset) {
+            size_t n = std::min(offset - m_position, INPUT_BYTES);
+
+            dropped.resize(n);
+
+            if (!decompress(dropped.data(), n)) return false;
+
+            m_position += n;
+        }
+
+        if (!decompress(dst, count)) return false;
+
+        m_position += count;
+
+        return true;
+    }
+};
+
+// Slab budget for compressed inputs when none is given
+constexpr size_t DEFAULT_SLAB_BYTES = size_t(512) << 20;
+
+// Convert a slab of planes at a time, slicing along the slowest axis in
+// storage. Two sets of slab buffers are used: the next slab is read on
+// another thread while the current one is built, so input memory is bounded
+// by the slab budget rather than the file size. With a region of interest or
+// stride, only the sampled planes are read, packed into the slab buffers.
+template <class T, MemoryOrder O>
+FloatGrids stream_binary(BinaryLayout const&   layout,
+                         std::array<size_t, 3> dims,
+                         Config const&         config) {
+    auto const box = sample_box(dims, config);
+
+    // one reporter over every slab
+    auto const c = with_progress(
+        config, uint64_t(box.dims[0]) * box.dims[1] * box.dims[2]);
+
+    size_t const axis   = slowest_axis(O);
+    size_t const stride = layout.stride();
+    size_t const nfiles = layout.files.size();
+
+    size_t const plane_elements = dims[0] * dims[1] * dims[2] / dims[axis];
+    size_t const plane_bytes    = plane_elements * stride * sizeof(T);
+
+    for (auto const& file : layout.files) {
+        // the size of compressed data is only known once it is read
+        if (compression_of(file) != Compression::NONE) continue;
+
+        if (fs::file_size(file) < dims[axis] * plane_bytes) {
+            throw std::runtime_error(
+                "File is smaller than the given dimensions");
+        }
+    }
+
+    // keep slabs aligned to tiles when the budget allows, and to leaves
+    // otherwise, so slab grids merge by moving whole nodes
+    constexpr size_t LEAF_DIM = openvdb::FloatTree::LeafNodeType::DIM;
+
+    size_t const budget = c.bin_slab_bytes.value_or(DEFAULT_SLAB_BYTES);
+
+    size_t planes = budget / 2 / (plane_bytes * nfiles);
+
+    if (planes >= TileLayout::TILE_DIM) {
+        planes -= planes % TileLayout::TILE_DIM;
+    } else {
+        planes -= planes % LEAF_DIM;
+    }
+
+    if (planes == 0) {
+        std::cerr << "Slab budget is too small, using " << LEAF_DIM
+                  << " planes per slab.\n";
+        planes = LEAF_DIM;
+    }
+
+    // sampled planes, and the box over the packed slab buffers, where
+    // sampled plane i is plane i
+    size_t const sampled = box.dims[axis];
+
+    SampleBox packed = box;
+    packed.lo[axis]     = 0;
+    packed.stride[axis] = 1;
+
+    std::array<size_t, 3> packed_dims = dims;
+    packed_dims[axis]                 = sampled;
+
+    // slabs end on multiples of planes in grid coordinates
+    auto slab_end = [&](size_t i0) {
+        size_t g0 = box.out_lo[axis] + i0;
+        return std::min((g0 / planes + 1) * planes - box.out_lo[axis], sampled);
+    };
+
+    planes = std::min(planes, dims[axis]);
+
+    std::cout << "Streaming " << planes << " planes per slab, "
+              << 2 * planes * plane_bytes * nfiles << " bytes buffered"
+              << std::endl;
+
+    std::vector<std::unique_ptr<SlabSource>> files;
+
+    for (auto const& file : layout.files) {
+        files.push_back(std::make_unique<SlabSource>(file));
+
+        if (files.back()->compressed()) {
+            std::cout << "Decompressing " << file << " while streaming"
+                      << std::endl;
+        }
+    }
+
+    // buffers[slot][file]
+    std::vector<std::unique_ptr<T[]>> buffers[2];
+
+    for (auto& slot : buffers) {
+        for (size_t i = 0; i < nfiles; i++) {
+            size_t count = planes * plane_elements * stride;
+
+            slot.emplace_back(new T[count]);
+
+            first_touch(reinterpret_cast<std::byte*>(slot.back().get()),
+                        count * sizeof(T),
+                        c);
+        }
+    }
+
+    // read sampled planes [i0, i1), in one run when they are contiguous
+    auto read_slab = [&](size_t i0, size_t slot) {
+        size_t i1 = slab_end(i0);
 
-    if (!r) throw std::runtime_error("Unable to read file");
+        size_t const step = box.stride[axis];
+        size_t const run  = step == 1 ? i1 - i0 : 1;
 
-    return process_with(dims, *r, name, c, is_double);
+        PhaseTimer timer(c, "read_slab", PhaseTimer::Clock::THREAD);
+        timer.add_bytes_read((i1 - i0) * plane_bytes * nfiles);
+
+        for (size_t i = 0; i < nfiles; i++) {
+            auto dst = reinterpret_cast<std::byte*>(buffers[slot][i].get());
+
+            for (size_t p = i0; p < i1; p += run) {
+                size_t const source = box.lo[axis] + p * step;
+
+                if (!files[i]->read(dst + (p - i0) * plane_bytes,
+                                    run * plane_bytes,
+                                    source * plane_bytes)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    };
+
+    if (!box.covers(dims)) {
+        std::cout << "Sampling " << box.dims[0] << " " << box.dims[1] << " "
+                  << box.dims[2] << " voxels from " << box.lo[0] << " "
+                  << box.lo[1] << " " << box.lo[2] << " with stride "
+                  << box.stride[0] << " " << box.stride[1] << " "
+                  << box.stride[2] << std::endl;
+    }
+
+    auto main_grids = make_grids(layout.field_count(), c);
+
+    std::future<bool> pending;
+
+    if (sampled) pending = std::async(std::launch::async, read_slab, 0, 0);
+
+    for (size_t i0 = 0, slot = 0; i0 < sampled; slot ^= 1) {
+        if (!pending.get()) throw std::runtime_error("Unable to read file");
+
+        size_t i1 = slab_end(i0);
+
+        if (i1 < sampled) {
+            pending = std::async(std::launch::async, read_slab, i1, slot ^ 1);
+        }
+
+        std::vector<std::byte const*> data;
+
+        for (auto const& buffer : buffers[slot]) {
+            data.push_back(reinterpret_cast<std::byte const*>(buffer.get()));
+        }
+
+        auto reader = make_field_reader<T, O>(packed_dims,
+                                              field_bases<T>(layout, data),
+                                              stride,
+                                              c,
+                                              i0 * plane_elements);
+
+        std::array<size_t, 3> lo = box.out_lo;
+        std::array<size_t, 3> hi;
+
+        for (size_t i = 0; i < 3; i++) {
+            hi[i] = box.out_lo[i] + box.dims[i];
+        }
+
+        lo[axis] = box.out_lo[axis] + i0;
+        hi[axis] = box.out_lo[axis] + i1;
+
+        auto slab_grids = build_open_vdb_fields_region(
+            lo,
+            hi,
+            layout.field_count(),
+            sampled_reader(reader, packed, layout.field_count()),
+            c,
+            O);
+
+        {
+            PhaseTimer timer(c, "merge_slab");
+
+            for (size_t f = 0; f < slab_grids.size(); f++) {
+                main_grids[f]->tree().merge(slab_grids[f]->tree());
+            }
+        }
+
+        if (c.has_flag("--progress")) {
+            std::cout << "Slab: " << i1 << "/" << sampled << std::endl;
+        }
+
+        i0 = i1;
+    }
+
+    for (auto& grid : main_grids) {
+        if (!box.covers(dims)) box.place(grid->transform());
+        prune_grid(*grid, c);
+    }
+
+    name_grids(main_grids, layout);
+
+    return main_grids;
+}
+
+template <class T>
+FloatGrids convert_with(BinaryLayout const&   layout,
+                        std::array<size_t, 3> dims,
+                        Config const&         c,
+                        bool                  use_memmap) {
+    // compressed inputs can only be read in order, so are always streamed
+    bool compressed = std::any_of(
+        layout.files.begin(), layout.files.end(), [](fs::path const& file) {
+            return compression_of(file) != Compression::NONE;
+        });
+
+    if (c.bin_slab_bytes || compressed) {
+        std::cout << "Using slab streaming..." << std::endl;
+
+        return dispatch_order(c.bin_order, [&](auto tag) {
+            return stream_binary<T, decltype(tag)::value>(layout, dims, c);
+        });
+    }
+
+    if (use_memmap) return convert_binary<T>(layout, dims, c, map_file_to);
+
+    return convert_binary<T>(layout, dims, c, [&](fs::path const& file) {
+        return read_file_into(file, c);
+    });
 }
 
 openvdb::GridPtrVec BinaryPlugin::convert(Config const& c) {
@@ -221,12 +739,9 @@ openvdb::GridPtrVec BinaryPlugin::convert(Config const& c) {
 
     if (!result.has_value()) return ret;
 
-    bool is_double = false;
+    auto type = get_type(c);
 
-    if (c.has_flag("--bin_double")) {
-        std::cout << "Using doubles..." << std::endl;
-        is_double = true;
-    }
+    if (!type) return ret;
 
     bool use_memmap = false;
 
@@ -237,37 +752,38 @@ openvdb::GridPtrVec BinaryPlugin::convert(Config const& c) {
 
     auto dims = result.value();
 
-    size_t total_element_count = dims[0] * dims[1] * dims[2];
-
-    size_t byte_count = total_element_count;
+    auto layout = get_layout(c);
 
-    if (is_double) {
-        byte_count *= sizeof(double);
-    } else {
-        byte_count *= sizeof(float);
+    if (layout.field_count() == 0) {
+        std::cerr << "No binary fields given.\n";
+        return ret;
     }
 
-    std::cout << "Reading " << byte_count << " bytes...\n";
+    size_t total_element_count = dims[0] * dims[1] * dims[2];
 
-    auto data_name = c.input_path.stem().string();
+    size_t byte_count = total_element_count * layout.stride();
 
-    { // remap name
-        auto iter = c.name_map.find(data_name);
+    std::visit([&](auto tag) { byte_count *= sizeof(tag); }, *type);
 
-        if (iter != c.name_map.end()) { data_name = iter->second; }
-    }
+    std::cout << "Reading " << byte_count << " bytes from each of "
+              << layout.files.size() << " file(s)...\n";
 
-    std::cout << "Storing data in field: " << data_name << std::endl;
+    for (auto const& name : layout.names) {
+        std::cout << "Storing data in field: " << name << std::endl;
+    }
 
+    if (c.bin_scale != 1 || c.bin_offset != 0) {
+        std::cout << "Mapping values to v * " << c.bin_scale << " + "
+                  << c.bin_offset << std::endl;
+    }
 
-    if (use_memmap) {
-        ret.push_back(
-            convert_binary(dims, data_name, c, is_double, map_file_to));
+    auto grids = std::visit(
+        [&](auto tag) {
+            return convert_with<decltype(tag)>(layout, dims, c, use_memmap);
+        },
+        *type);
 
-    } else {
-        ret.push_back(
-            convert_binary(dims, data_name, c, is_double, read_file_into));
-    }
+    ret.insert(ret.end(), grids.begin(), grids.end());
 
     return ret;
 }
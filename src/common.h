@@ -1,13 +1,48 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+#include <array>
 #include <filesystem>
+#include <memory>
 #include <optional>
 #include <string>
 #include <unordered_map>
 
 namespace fs = std::filesystem;
 
+class ProgressReporter;
+class StatsLog;
+
+enum class BuildEngine {
+    // Write voxels one at a time through a ValueAccessor
+    ACCESSOR,
+    // Fill whole leaf nodes and attach them to the tree
+    LEAF,
+};
+
+// Memory order of a dense source. C: the last index (Z) varies fastest.
+// F: the first index (X) varies fastest.
+enum class MemoryOrder {
+    C,
+    F,
+};
+
+// Compression codec for output files. DEFAULT leaves the OpenVDB default.
+enum class OutputCodec {
+    DEFAULT,
+    BLOSC,
+    ZIP,
+    NONE,
+};
+
+// How a 2^3 block of voxels is reduced to one voxel of a coarser LOD
+enum class LodReduce {
+    // Mean of the block, inactive voxels counting as background
+    MEAN,
+    // Largest active value of the block
+    MAX,
+};
+
 struct Config {
     std::string requested_plugin;
 
@@ -25,10 +60,70 @@ struct Config {
 
     bool use_threads = true;
 
+    // Cap on TBB workers (0: no cap), the grain size of the build loop,
+    // pinning of workers to cores, and first touch of read buffers from the
+    // workers for NUMA placement
+    int    thread_limit     = 0;
+    size_t grain_size       = 1;
+    bool   pin_threads      = false;
+    bool   numa_first_touch = false;
+
+    BuildEngine engine = BuildEngine::ACCESSOR;
+
     std::optional<float> prune_amount;
 
+    // Sparse build: values within tolerance of the background are left out
+    // while building, instead of being pruned afterwards.
+    std::optional<float> sparse_background;
+    float                sparse_tolerance = 0;
+
     std::optional<std::string> bin_dims;
 
+    // Region of interest of dense sources, [lo, hi) per axis
+    std::optional<std::array<std::array<size_t, 2>, 3>> roi;
+
+    // Step between sampled voxels of dense sources along each axis
+    std::array<size_t, 3> sample_stride = { 1, 1, 1 };
+
+    // Binary element type (float32 by default), and a mapping applied to
+    // each value: v * bin_scale + bin_offset
+    std::optional<std::string> bin_type;
+    float                      bin_scale  = 1;
+    float                      bin_offset = 0;
+
+    // Batch conversion: a list file or glob of inputs
+    std::optional<std::string> batch;
+    std::optional<fs::path>    batch_output_dir;
+    int                        batch_inflight = 3;
+
+    MemoryOrder bin_order = MemoryOrder::C;
+
+    // Comma separated field names for multi-field binary input. Fields are
+    // interleaved per voxel, or in sibling files if bin_field_files is set.
+    std::optional<std::string> bin_fields;
+    bool                       bin_field_files = false;
+
+    // Stream binary input in slabs using at most this many bytes of buffers
+    std::optional<size_t> bin_slab_bytes;
+
+    // Grids to store as half floats: comma separated names, or "all"
+    std::optional<std::string> half_grids;
+
+    OutputCodec output_codec = OutputCodec::DEFAULT;
+
+    // Coarser levels of detail to add beside each grid, each at half the
+    // resolution of the last
+    int       lod_levels = 0;
+    LodReduce lod_reduce = LodReduce::MEAN;
+
+    // Phase statistics for --stats, shared by copies of the config
+    std::shared_ptr<StatsLog> stats;
+    std::optional<fs::path>   stats_path;
+
+    // Progress of a conversion made of several builds, shared by them so
+    // that it runs once from 0 to 100%
+    std::shared_ptr<ProgressReporter> progress;
+
     std::string get_flag(std::string key) const {
         auto iter = all_flags.find(key);
         if (iter == all_flags.end()) return {};
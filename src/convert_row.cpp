@@ -0,0 +1,265 @@
+#include "convert_row.h"
+
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#    define CONVERT_ROW_X86
+#    include <immintrin.h>
+#endif
+
+namespace {
+
+template <class T>
+void convert_scalar(T const* in,
+                    size_t   stride,
+                    size_t   count,
+                    float*   out,
+                    float    scale,
+                    float    offset) {
+    for (size_t i = 0; i < count; i++) {
+        out[i] = float(in[i * stride]) * scale + offset;
+    }
+}
+
+#ifdef CONVERT_ROW_X86
+
+// Kernels are compiled for their instruction set regardless of the build
+// flags, and only called once the CPU is known to support it. Every AVX2
+// processor also has F16C.
+
+#    define AVX2_TARGET  __attribute__((target("avx2,f16c")))
+#    define SSE41_TARGET __attribute__((target("sse4.1")))
+
+enum class Kernel { SCALAR, SSE41, AVX2 };
+
+Kernel detect_kernel() {
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c")) {
+        return Kernel::AVX2;
+    }
+
+    if (__builtin_cpu_supports("sse4.1")) return Kernel::SSE41;
+
+    return Kernel::SCALAR;
+}
+
+Kernel best_kernel() {
+    static Kernel const kernel = detect_kernel();
+    return kernel;
+}
+
+// Load 8 values, widened to float
+
+AVX2_TARGET inline __m256 load8(uint8_t const* p) {
+    auto v = _mm_loadl_epi64(reinterpret_cast<__m128i const*>(p));
+    return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v));
+}
+
+AVX2_TARGET inline __m256 load8(int8_t const* p) {
+    auto v = _mm_loadl_epi64(reinterpret_cast<__m128i const*>(p));
+    return _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(v));
+}
+
+AVX2_TARGET inline __m256 load8(uint16_t const* p) {
+    auto v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+    return _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(v));
+}
+
+AVX2_TARGET inline __m256 load8(int16_t const* p) {
+    auto v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+    return _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(v));
+}
+
+AVX2_TARGET inline __m256 load8(int32_t const* p) {
+    auto v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(p));
+    return _mm256_cvtepi32_ps(v);
+}
+
+AVX2_TARGET inline __m256 load8(HalfBits const* p) {
+    auto v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+    return _mm256_cvtph_ps(v);
+}
+
+AVX2_TARGET inline __m256 load8(float const* p) { return _mm256_loadu_ps(p); }
+
+AVX2_TARGET inline __m256 load8(double const* p) {
+    return _mm256_set_m128(_mm256_cvtpd_ps(_mm256_loadu_pd(p + 4)),
+                           _mm256_cvtpd_ps(_mm256_loadu_pd(p)));
+}
+
+// Load 4 values, widened to float
+
+SSE41_TARGET inline __m128 load4(uint8_t const* p) {
+    int32_t bytes;
+    std::memcpy(&bytes, p, sizeof(bytes));
+    return _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes)));
+}
+
+SSE41_TARGET inline __m128 load4(int8_t const* p) {
+    int32_t bytes;
+    std::memcpy(&bytes, p, sizeof(bytes));
+    return _mm_cvtepi32_ps(_mm_cvtepi8_epi32(_mm_cvtsi32_si128(bytes)));
+}
+
+SSE41_TARGET inline __m128 load4(uint16_t const* p) {
+    auto v = _mm_loadl_epi64(reinterpret_cast<__m128i const*>(p));
+    return _mm_cvtepi32_ps(_mm_cvtepu16_epi32(v));
+}
+
+SSE41_TARGET inline __m128 load4(int16_t const* p) {
+    auto v = _mm_loadl_epi64(reinterpret_cast<__m128i const*>(p));
+    return _mm_cvtepi32_ps(_mm_cvtepi16_epi32(v));
+}
+
+SSE41_TARGET inline __m128 load4(int32_t const* p) {
+    return _mm_cvtepi32_ps(
+        _mm_loadu_si128(reinterpret_cast<__m128i const*>(p)));
+}
+
+SSE41_TARGET inline __m128 load4(float const* p) { return _mm_loadu_ps(p); }
+
+SSE41_TARGET inline __m128 load4(double const* p) {
+    return _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(p)),
+                         _mm_cvtpd_ps(_mm_loadu_pd(p + 2)));
+}
+
+template <class T>
+AVX2_TARGET void convert_avx2(T const* in,
+                              size_t   count,
+                              float*   out,
+                              float    scale,
+                              float    offset) {
+    __m256 const s = _mm256_set1_ps(scale);
+    __m256 const o = _mm256_set1_ps(offset);
+
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m256 v = _mm256_add_ps(_mm256_mul_ps(load8(in + i), s), o);
+        _mm256_storeu_ps(out + i, v);
+    }
+
+    convert_scalar(in + i, 1, count - i, out + i, scale, offset);
+}
+
+template <class T>
+SSE41_TARGET void convert_sse41(T const* in,
+                                size_t   count,
+                                float*   out,
+                                float    scale,
+                                float    offset) {
+    __m128 const s = _mm_set1_ps(scale);
+    __m128 const o = _mm_set1_ps(offset);
+
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        __m128 v = _mm_add_ps(_mm_mul_ps(load4(in + i), s), o);
+        _mm_storeu_ps(out + i, v);
+    }
+
+    convert_scalar(in + i, 1, count - i, out + i, scale, offset);
+}
+
+#endif // CONVERT_ROW_X86
+
+template <class T>
+void convert_any(T const* in,
+                 size_t   stride,
+                 size_t   count,
+                 float*   out,
+                 float    scale,
+                 float    offset) {
+#ifdef CONVERT_ROW_X86
+    // interleaved fields would need a gather, which is no faster
+    if (stride == 1) {
+        switch (best_kernel()) {
+        case Kernel::AVX2: return convert_avx2(in, count, out, scale, offset);
+        case Kernel::SSE41:
+            // no half conversion before F16C
+            if constexpr (!std::is_same_v<T, HalfBits>) {
+                return convert_sse41(in, count, out, scale, offset);
+            }
+            break;
+        case Kernel::SCALAR: break;
+        }
+    }
+#endif
+
+    convert_scalar(in, stride, count, out, scale, offset);
+}
+
+} // namespace
+
+void convert_row(uint8_t const* in,
+                 size_t         stride,
+                 size_t         count,
+                 float*         out,
+                 float          scale,
+                 float          offset) {
+    convert_any(in, stride, count, out, scale, offset);
+}
+
+void convert_row(int8_t const* in,
+                 size_t        stride,
+                 size_t        count,
+                 float*        out,
+                 float         scale,
+                 float         offset) {
+    convert_any(in, stride, count, out, scale, offset);
+}
+
+void convert_row(uint16_t const* in,
+                 size_t          stride,
+                 size_t          count,
+                 float*          out,
+                 float           scale,
+                 float           offset) {
+    convert_any(in, stride, count, out, scale, offset);
+}
+
+void convert_row(int16_t const* in,
+                 size_t         stride,
+                 size_t         count,
+                 float*         out,
+                 float          scale,
+                 float          offset) {
+    convert_any(in, stride, count, out, scale, offset);
+}
+
+void convert_row(int32_t const* in,
+                 size_t         stride,
+                 size_t         count,
+                 float*         out,
+                 float          scale,
+                 float          offset) {
+    convert_any(in, stride, count, out, scale, offset);
+}
+
+void convert_row(HalfBits const* in,
+                 size_t          stride,
+                 size_t          count,
+                 float*          out,
+                 float           scale,
+                 float           offset) {
+    convert_any(in, stride, count, out, scale, offset);
+}
+
+void convert_row(float const* in,
+                 size_t       stride,
+                 size_t       count,
+                 float*       out,
+                 float        scale,
+                 float        offset) {
+    convert_any(in, stride, count, out, scale, offset);
+}
+
+void convert_row(double const* in,
+                 size_t        stride,
+                 size_t        count,
+                 float*        out,
+                 float         scale,
+                 float         offset) {
+    convert_any(in, stride, count, out, scale, offset);
+}
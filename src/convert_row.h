@@ -0,0 +1,100 @@
+#ifndef CONVERT_ROW_H
+#define CONVERT_ROW_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// An IEEE 754 half precision value, as stored on disk
+struct HalfBits {
+    uint16_t bits;
+
+    explicit operator float() const {
+        uint32_t sign = uint32_t(bits & 0x8000) << 16;
+        uint32_t exp  = (bits >> 10) & 0x1f;
+        uint32_t mant = bits & 0x3ff;
+        uint32_t ret;
+
+        if (exp == 0x1f) {
+            ret = sign | 0x7f800000 | (mant << 13);
+        } else if (exp != 0) {
+            ret = sign | ((exp + 112) << 23) | (mant << 13);
+        } else if (mant == 0) {
+            ret = sign;
+        } else {
+            // subnormal half, normal float
+            exp = 113;
+            while (!(mant & 0x400)) {
+                mant <<= 1;
+                exp--;
+            }
+            ret = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+        }
+
+        float f;
+        std::memcpy(&f, &ret, sizeof(f));
+        return f;
+    }
+};
+
+// Convert count values, stride elements apart, to float(v) * scale + offset.
+// Contiguous rows are converted with SSE4.1 or AVX2 kernels when the CPU has
+// them, and element by element otherwise.
+
+void convert_row(uint8_t const* in,
+                 size_t         stride,
+                 size_t         count,
+                 float*         out,
+                 float          scale,
+                 float          offset);
+
+void convert_row(int8_t const* in,
+                 size_t        stride,
+                 size_t        count,
+                 float*        out,
+                 float         scale,
+                 float         offset);
+
+void convert_row(uint16_t const* in,
+                 size_t          stride,
+                 size_t          count,
+                 float*          out,
+                 float           scale,
+                 float           offset);
+
+void convert_row(int16_t const* in,
+                 size_t         stride,
+                 size_t         count,
+                 float*         out,
+                 float          scale,
+                 float          offset);
+
+void convert_row(int32_t const* in,
+                 size_t         stride,
+                 size_t         count,
+                 float*         out,
+                 float          scale,
+                 float          offset);
+
+void convert_row(HalfBits const* in,
+                 size_t          stride,
+                 size_t          count,
+                 float*          out,
+                 float           scale,
+                 float           offset);
+
+void convert_row(float const* in,
+                 size_t       stride,
+                 size_t       count,
+                 float*       out,
+                 float        scale,
+                 float        offset);
+
+void convert_row(double const* in,
+                 size_t        stride,
+                 size_t        count,
+                 float*        out,
+                 float         scale,
+                 float         offset);
+
+#endif // CONVERT_ROW_H
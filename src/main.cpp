@@ -1,10 +1,10 @@
 #include "common.h"
 
-#ifdef ENABLE_VTK
-#    include "vtkplugin.h"
-#endif
-
-#include "binaryplugin.h"
+#include "batch.h"
+#include "makeopenvdb.h"
+#include "stats.h"
+#include "threading.h"
+#include "vdb_writer.h"
 
 #include <cxxopts.hpp>
 
@@ -12,8 +12,11 @@
 #include <openvdb/tools/Composite.h>
 #include <openvdb/tools/Prune.h>
 
+#include <algorithm>
 #include <array>
-#include <cxxabi.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
 #include <queue>
 #include <string_view>
@@ -61,8 +64,30 @@ Config configure(cxxopts::ParseResult& result) {
         }
     });
 
-    test_and_set<int>(
-        result, "threads", [&](auto v) { config.use_threads = v; });
+    test_and_set<int>(result, "threads", [&](auto v) {
+        config.use_threads  = v != 0;
+        config.thread_limit = std::max(v, 0);
+    });
+
+    test_and_set<int>(result, "grain", [&](auto v) {
+        if (v > 0) config.grain_size = v;
+    });
+
+    test_and_set<bool>(
+        result, "pin", [&](auto v) { config.pin_threads = v; });
+
+    test_and_set<bool>(
+        result, "numa", [&](auto v) { config.numa_first_touch = v; });
+
+    test_and_set<std::string>(result, "engine", [&](auto v) {
+        if (v == "leaf") {
+            std::cout << "Using leaf build engine." << std::endl;
+            config.engine = BuildEngine::LEAF;
+        } else if (v != "accessor") {
+            std::cerr << "Unknown build engine " << v
+                      << ", using accessor.\n";
+        }
+    });
 
     test_and_set<bool>(result, "prune", [&](auto v) {
         if (v) {
@@ -77,19 +102,201 @@ Config configure(cxxopts::ParseResult& result) {
         config.prune_amount = v;
     });
 
+    test_and_set<std::string>(result, "background", [&](auto v) {
+        if (v.empty()) return;
+
+        // test_and_set swallows exceptions, so check the parse here
+        char* end        = nullptr;
+        float background = std::strtof(v.c_str(), &end);
+
+        if (end == v.c_str() || *end != '\0') {
+            std::cerr << "Bad background value " << v << ".\n";
+            std::exit(EXIT_FAILURE);
+        }
+
+        config.sparse_background = background;
+        std::cout << "Sparse build, background: " << v << std::endl;
+    });
+
+    test_and_set<float>(result, "tolerance", [&](auto v) {
+        if (v < 0) return;
+        config.sparse_tolerance = v;
+    });
+
     test_and_set<std::string>(result, "bin_dims", [&](auto v) {
         if (v.empty()) return;
         std::cout << "Bin Dims: " << v << std::endl;
         config.bin_dims = v;
     });
 
+    test_and_set<std::string>(result, "roi", [&](auto v) {
+        if (v.empty()) return;
+
+        std::array<std::array<size_t, 2>, 3> roi;
+
+        // characters consumed, to reject trailing text
+        int used = 0;
+
+        int n = std::sscanf(v.c_str(),
+                            "%zu:%zu,%zu:%zu,%zu:%zu%n",
+                            &roi[0][0],
+                            &roi[0][1],
+                            &roi[1][0],
+                            &roi[1][1],
+                            &roi[2][0],
+                            &roi[2][1],
+                            &used);
+
+        bool ordered = std::all_of(
+            roi.begin(), roi.end(), [](auto r) { return r[0] < r[1]; });
+
+        if (n != 6 || size_t(used) != v.size() || !ordered) {
+            std::cerr << "Bad region of interest " << v
+                      << ", expected x0:x1,y0:y1,z0:z1.\n";
+            std::exit(EXIT_FAILURE);
+        }
+
+        std::cout << "Region of interest: " << v << std::endl;
+        config.roi = roi;
+    });
+
+    test_and_set<std::string>(result, "stride", [&](auto v) {
+        if (v.empty()) return;
+
+        std::array<size_t, 3> stride = { 0, 0, 0 };
+
+        // characters consumed, to reject trailing text
+        int used = 0;
+
+        int n = std::sscanf(v.c_str(), "%zu%n", &stride[0], &used);
+
+        // a single value applies to every axis
+        if (n == 1 && size_t(used) == v.size()) {
+            stride[1] = stride[2] = stride[0];
+        } else {
+            n = std::sscanf(v.c_str(),
+                            "%zu:%zu:%zu%n",
+                            &stride[0],
+                            &stride[1],
+                            &stride[2],
+                            &used);
+        }
+
+        bool positive = std::all_of(
+            stride.begin(), stride.end(), [](size_t s) { return s > 0; });
+
+        if ((n != 1 && n != 3) || size_t(used) != v.size() || !positive) {
+            std::cerr << "Bad stride " << v << ", expected sx:sy:sz.\n";
+            std::exit(EXIT_FAILURE);
+        }
+
+        std::cout << "Stride: " << v << std::endl;
+        config.sample_stride = stride;
+    });
+
+    test_and_set<std::string>(result, "bin_type", [&](auto v) {
+        if (!v.empty()) config.bin_type = v;
+    });
+
+    test_and_set<float>(
+        result, "bin_scale", [&](auto v) { config.bin_scale = v; });
+
+    test_and_set<float>(
+        result, "bin_offset", [&](auto v) { config.bin_offset = v; });
+
+
+    test_and_set<std::string>(result, "bin_order", [&](auto v) {
+        if (v == "F" || v == "f") {
+            std::cout << "Bin order: F" << std::endl;
+            config.bin_order = MemoryOrder::F;
+        } else if (v != "C" && v != "c") {
+            std::cerr << "Unknown binary order " << v << ", using C.\n";
+        }
+    });
+
+    test_and_set<std::string>(result, "bin_fields", [&](auto v) {
+        if (v.empty()) return;
+        std::cout << "Bin fields: " << v << std::endl;
+        config.bin_fields = v;
+    });
+
+    test_and_set<std::string>(result, "bin_layout", [&](auto v) {
+        if (v == "files") {
+            config.bin_field_files = true;
+        } else if (v != "interleaved") {
+            std::cerr << "Unknown binary layout " << v
+                      << ", using interleaved.\n";
+        }
+    });
+
+    test_and_set<int>(result, "bin_stream", [&](auto v) {
+        if (v <= 0) return;
+        std::cout << "Bin slab budget: " << v << " MiB" << std::endl;
+        config.bin_slab_bytes = size_t(v) << 20;
+    });
+
+    test_and_set<std::string>(result, "half", [&](auto v) {
+        if (v.empty()) return;
+        std::cout << "Half float grids: " << v << std::endl;
+        config.half_grids = v;
+    });
+
+    test_and_set<std::string>(result, "codec", [&](auto v) {
+        if (v == "blosc") {
+            config.output_codec = OutputCodec::BLOSC;
+        } else if (v == "zip") {
+            config.output_codec = OutputCodec::ZIP;
+        } else if (v == "none") {
+            config.output_codec = OutputCodec::NONE;
+        } else if (!v.empty()) {
+            std::cerr << "Unknown codec " << v << ", using default.\n";
+        }
+    });
+
+    test_and_set<int>(result, "lod", [&](auto v) {
+        config.lod_levels = std::max(v, 0);
+    });
+
+    test_and_set<std::string>(result, "lod_reduce", [&](auto v) {
+        if (v == "max") {
+            config.lod_reduce = LodReduce::MAX;
+        } else if (v != "mean") {
+            std::cerr << "Unknown LOD reduction " << v << ", using mean.\n";
+        }
+    });
+
+    test_and_set<std::string>(result, "stats", [&](auto v) {
+        if (v.empty()) return;
+        config.stats      = std::make_shared<StatsLog>();
+        config.stats_path = fs::path(v);
+    });
+
+    test_and_set<std::string>(result, "batch", [&](auto v) {
+        if (!v.empty()) config.batch = v;
+    });
+
+    test_and_set<std::string>(result, "batch_out", [&](auto v) {
+        if (!v.empty()) config.batch_output_dir = fs::path(v);
+    });
+
+    test_and_set<int>(
+        result, "batch_inflight", [&](auto v) { config.batch_inflight = v; });
+
+    if (result.count("input")) {
+        config.input_path = result["input"].as<std::string>();
+
+        // directory inputs, like plotfiles, may be given with a trailing /
+        if (!config.input_path.has_filename()) {
+            config.input_path = config.input_path.parent_path();
+        }
+    }
 
-    config.input_path  = result["input"].as<std::string>();
-    config.output_path = result["output"].as<std::string>();
+    if (result.count("output")) {
+        config.output_path = result["output"].as<std::string>();
+    }
 
     if (config.output_path.empty()) {
-        config.output_path = config.input_path;
-        config.output_path.replace_extension(".vdb");
+        config.output_path = default_output_path(config.input_path);
     }
 
     if (config.num_samples and config.num_samples <= 0) {
@@ -104,8 +311,12 @@ Config configure(cxxopts::ParseResult& result) {
         config.all_flags[kv] = std::string("1");
     }
 
-    std::cout << "Input file:  " << config.input_path << "\n";
-    std::cout << "Output file: " << config.output_path << "\n";
+    if (config.batch) {
+        std::cout << "Batch:       " << *config.batch << "\n";
+    } else {
+        std::cout << "Input file:  " << config.input_path << "\n";
+        std::cout << "Output file: " << config.output_path << "\n";
+    }
     std::cout << "Mapping:\n";
     for (auto const& [k, v] : config.name_map) {
         std::cout << "\t" << k << " -> " << v << "\n";
@@ -115,38 +326,81 @@ Config configure(cxxopts::ParseResult& result) {
 }
 
 
-using PluginHandler = std::function<bool(fs::path const&)>;
+bool saves_as_half(Config const& config, std::string_view name) {
+    if (!config.half_grids) return false;
 
-std::vector<PluginHandler>                             plugins;
-std::unordered_map<std::string, std::function<void()>> plugin_map;
+    std::string_view list = *config.half_grids;
 
-template <class T>
-void install_plugin(openvdb::GridPtrVec& grids, Config const& config) {
+    if (list == "all") return true;
 
-    {
-        size_t length = 0;
-        int    status = 0;
-        char*  type_name =
-            abi::__cxa_demangle(typeid(T).name(), nullptr, &length, &status);
+    while (!list.empty()) {
+        auto comma = list.find(',');
 
-        plugin_map[type_name] = [&grids, &config]() {
-            T p(config);
-            grids = p.convert(config);
-        };
+        if (list.substr(0, comma) == name) return true;
 
-        std::cout << "Registering " << type_name << "\n";
+        if (comma == std::string_view::npos) break;
 
-        free(type_name);
+        list.remove_prefix(comma + 1);
     }
 
-    plugins.push_back([&grids, &config](fs::path const& ext) {
-        if (!T::recognized(ext)) return false;
+    return false;
+}
 
-        T p(config);
-        grids = p.convert(config);
+uint32_t compression_flags(OutputCodec codec) {
+    using namespace openvdb::io;
 
-        return true;
-    });
+    switch (codec) {
+    case OutputCodec::BLOSC:
+        if (Archive::hasBloscCompression()) {
+            return COMPRESS_BLOSC | COMPRESS_ACTIVE_MASK;
+        }
+        std::cerr << "Blosc is not available, using zip.\n";
+        [[fallthrough]];
+    case OutputCodec::ZIP: return COMPRESS_ZIP | COMPRESS_ACTIVE_MASK;
+    case OutputCodec::NONE: return COMPRESS_NONE;
+    case OutputCodec::DEFAULT: break;
+    }
+
+    return Archive::DEFAULT_COMPRESSION_FLAGS;
+}
+
+void write_grids(Config const& config, openvdb::GridPtrVec const& grids) {
+    for (auto const& grid : grids) {
+        if (saves_as_half(config, grid->getName())) {
+            grid->setSaveFloatAsHalf(true);
+        }
+    }
+
+    PhaseTimer timer(config, "write");
+    timer.add_grids(grids);
+
+    auto start = std::chrono::steady_clock::now();
+
+    bool parallel = config.use_threads && !config.has_flag("--serial_write");
+
+    write_vdb(config.output_path,
+              grids,
+              compression_flags(config.output_codec),
+              parallel);
+
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    auto bytes = fs::file_size(config.output_path);
+
+    timer.add_bytes_written(bytes);
+
+    std::cout << "Wrote " << bytes << " bytes to " << config.output_path
+              << " in " << elapsed.count() << " s" << std::endl;
+}
+
+void write_stats(Config const& config) {
+    if (!config.stats) return;
+
+    if (!config.stats->write_json(*config.stats_path)) {
+        std::cerr << "Unable to write stats to " << *config.stats_path
+                  << "\n";
+    }
 }
 
 
@@ -180,17 +434,89 @@ int main(int argc, char* argv[]) {
              "Requested AMR Level",
              cxxopts::value<int>()->default_value("-1"))
             ("threads",
-             "Enable the use of threads (on by default)",
+             "Worker threads: -1 for all cores, 0 for serial, N to cap at N",
+             cxxopts::value<int>()->default_value("-1"))
+            ("grain",
+             "Grain size, in tiles, of the parallel build loop",
              cxxopts::value<int>()->default_value("1"))
+            ("pin",
+             "Pin worker threads to cores",
+             cxxopts::value<bool>()->default_value("false"))
+            ("numa",
+             "Touch read buffers from the workers for NUMA placement",
+             cxxopts::value<bool>()->default_value("false"))
+            ("engine",
+             "VDB build engine: accessor (per voxel) or leaf (per leaf node)",
+             cxxopts::value<std::string>()->default_value("accessor"))
             ("prune",
              "Permit pruning",
              cxxopts::value<bool>()->default_value("false"))
             ("prune_amount",
              "Set pruning tolerance",
              cxxopts::value<float>()->default_value("-1"))
+            ("background",
+             "Enable a sparse build: values near this are never stored",
+             cxxopts::value<std::string>()->default_value(""))
+            ("tolerance",
+             "Tolerance around the background for a sparse build",
+             cxxopts::value<float>()->default_value("0"))
             ("bin_dims",
              "Set binary volume dimensions",
              cxxopts::value<std::string>()->default_value(""))
+            ("roi",
+             "Only convert voxels x0:x1,y0:y1,z0:z1 (half open) of dense "
+             "inputs",
+             cxxopts::value<std::string>()->default_value(""))
+            ("stride",
+             "Keep every sx:sy:sz voxel of dense inputs, or every n on all "
+             "axes",
+             cxxopts::value<std::string>()->default_value(""))
+            ("bin_type",
+             "Binary element type: float32, float64, float16, int8, uint8, "
+             "int16, uint16 or int32",
+             cxxopts::value<std::string>()->default_value(""))
+            ("bin_scale",
+             "Scale applied to binary values",
+             cxxopts::value<float>()->default_value("1"))
+            ("bin_offset",
+             "Offset added to binary values after scaling",
+             cxxopts::value<float>()->default_value("0"))
+            ("bin_order",
+             "Binary memory order: C (Z fastest) or F (X fastest)",
+             cxxopts::value<std::string>()->default_value("C"))
+            ("bin_fields",
+             "Comma separated field names for multi-field binary input",
+             cxxopts::value<std::string>()->default_value(""))
+            ("bin_layout",
+             "Multi-field layout: interleaved (per voxel) or files (siblings)",
+             cxxopts::value<std::string>()->default_value("interleaved"))
+            ("bin_stream",
+             "Stream binary input in slabs, with this buffer budget in MiB",
+             cxxopts::value<int>()->default_value("0"))
+            ("half",
+             "Store grids as half floats: comma separated names, or all",
+             cxxopts::value<std::string>()->default_value(""))
+            ("codec",
+             "Output compression: blosc, zip or none",
+             cxxopts::value<std::string>()->default_value(""))
+            ("lod",
+             "Add this many coarser LOD grids, each at half resolution",
+             cxxopts::value<int>()->default_value("0"))
+            ("lod_reduce",
+             "LOD reduction of each 2x2x2 block: mean or max",
+             cxxopts::value<std::string>()->default_value("mean"))
+            ("stats",
+             "Write per-phase timing and memory statistics as JSON to a file",
+             cxxopts::value<std::string>()->default_value(""))
+            ("batch",
+             "Convert many inputs: a file listing paths, or a glob pattern",
+             cxxopts::value<std::string>()->default_value(""))
+            ("batch_out",
+             "Output directory for batch mode (default: beside each input)",
+             cxxopts::value<std::string>()->default_value(""))
+            ("batch_inflight",
+             "Maximum number of batch frames in flight",
+             cxxopts::value<int>()->default_value("3"))
             ("i,input", "Input file", cxxopts::value<std::string>())
             ("o,output", "Output file", cxxopts::value<std::string>())
             ("positional",
@@ -215,47 +541,50 @@ int main(int argc, char* argv[]) {
     std::cout << "Platform concurrency " << std::thread::hardware_concurrency()
               << "\n";
 
+    ThreadSettings thread_settings(config);
+    thread_settings.report(config);
 
-    if (!fs::is_regular_file(config.input_path)) {
-        if (!fs::is_directory(config.input_path)) {
-            std::cerr << "Unable to open input file!\n";
-            return EXIT_FAILURE;
-        }
-    }
-
-    std::cout << "Loading...\n";
 
+    if (config.batch) {
+        auto inputs = collect_batch_inputs(*config.batch);
 
-    openvdb::GridPtrVec grids;
-
-    auto ext = config.input_path.extension();
+        if (inputs.empty()) {
+            std::cerr << "No batch inputs found!\n";
+            return EXIT_FAILURE;
+        }
 
-#ifdef ENABLE_VTK
-    install_plugin<VTKPlugin>(grids, config);
-#endif
+        std::cout << "Batch of " << inputs.size() << " inputs, "
+                  << config.batch_inflight << " in flight\n";
 
-    install_plugin<BinaryPlugin>(grids, config);
+        auto failures = run_batch(config, inputs, convert_file, write_grids);
 
-    if (config.requested_plugin.size()) {
-        auto iter = plugin_map.find(config.requested_plugin);
+        write_stats(config);
 
-        if (iter == plugin_map.end()) {
-            std::cerr << "Unknown plugin requested!\n";
+        if (failures) {
+            std::cerr << failures << " of " << inputs.size()
+                      << " conversions failed!\n";
+            return EXIT_FAILURE;
         }
 
-        iter->second();
-    } else {
-        for (auto const& f : plugins) {
-            if (f(ext)) break;
+        return 0;
+    }
+
+    if (!fs::is_regular_file(config.input_path)) {
+        if (!fs::is_directory(config.input_path)) {
+            std::cerr << "Unable to open input file!\n";
+            return EXIT_FAILURE;
         }
     }
 
+    std::cout << "Loading...\n";
+
+    auto grids = convert_file(config);
+
     std::cout << "Starting VDB file write...\n";
 
-    openvdb::io::File file(config.output_path);
-    file.write(grids);
-    file.close();
+    write_grids(config, grids);
 
+    write_stats(config);
 
     return 0;
 }
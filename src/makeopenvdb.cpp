@@ -0,0 +1,216 @@
+#include "makeopenvdb.h"
+
+#ifdef ENABLE_VTK
+#    include "vtkplugin.h"
+#endif
+
+#include "amrexplugin.h"
+#include "binaryplugin.h"
+#include "convert_row.h"
+#include "rawplugin.h"
+#include "stats.h"
+#include "vdb_tools.h"
+
+#include <cxxabi.h>
+
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace {
+
+using PluginConvert = std::function<openvdb::GridPtrVec(Config const&)>;
+
+struct PluginEntry {
+    std::function<bool(fs::path const&)> recognized;
+    PluginConvert                        convert;
+};
+
+std::vector<PluginEntry>                       plugins;
+std::unordered_map<std::string, PluginConvert> plugin_map;
+
+template <class T>
+void install_plugin() {
+
+    auto convert = [](Config const& config) {
+        PhaseTimer timer(config, "convert");
+
+        T    p(config);
+        auto grids = p.convert(config);
+
+        add_lod_grids(grids, config);
+
+        timer.add_grids(grids);
+
+        return grids;
+    };
+
+    {
+        size_t length = 0;
+        int    status = 0;
+        char*  type_name =
+            abi::__cxa_demangle(typeid(T).name(), nullptr, &length, &status);
+
+        plugin_map[type_name] = convert;
+
+        std::cout << "Registering " << type_name << "\n";
+
+        free(type_name);
+    }
+
+    plugins.push_back({ &T::recognized, convert });
+}
+
+void install_plugins() {
+    static std::once_flag once;
+
+    std::call_once(once, []() {
+#ifdef ENABLE_VTK
+        install_plugin<VTKPlugin>();
+#endif
+
+        install_plugin<BinaryPlugin>();
+        install_plugin<AMReXPlugin>();
+        install_plugin<RawPlugin>();
+    });
+}
+
+// Reader over fields of one element type, each with its own strides
+template <class T>
+struct StridedReader {
+    std::vector<T const*>              bases;
+    std::vector<std::array<size_t, 3>> strides;
+
+    size_t element(size_t f, size_t x, size_t y, size_t z) const {
+        auto const& s = strides[f];
+        return x * s[0] + y * s[1] + z * s[2];
+    }
+
+    bool operator()(size_t x, size_t y, size_t z, float* out) const {
+        for (size_t f = 0; f < bases.size(); f++) {
+            out[f] = float(bases[f][element(f, x, y, z)]);
+        }
+
+        return true;
+    }
+
+    void read_row(size_t x,
+                  size_t y,
+                  size_t z,
+                  size_t axis,
+                  size_t count,
+                  float* out) const {
+        for (size_t f = 0; f < bases.size(); f++) {
+            convert_row(bases[f] + element(f, x, y, z),
+                        strides[f][axis],
+                        count,
+                        out + f * count,
+                        1,
+                        0);
+        }
+    }
+};
+
+template <class Function>
+decltype(auto) dispatch_dtype(DType dtype, Function&& f) {
+    switch (dtype) {
+    case DType::FLOAT16: return f(HalfBits());
+    case DType::FLOAT32: return f(float());
+    case DType::FLOAT64: return f(double());
+    case DType::INT8: return f(int8_t());
+    case DType::UINT8: return f(uint8_t());
+    case DType::INT16: return f(int16_t());
+    case DType::UINT16: return f(uint16_t());
+    case DType::INT32: return f(int32_t());
+    }
+
+    throw std::invalid_argument("Unknown dtype");
+}
+
+// Build fields sharing a dtype in one pass, walking memory in the order of
+// the first field's strides
+FloatGrids build_group(std::array<size_t, 3>         dims,
+                       std::vector<FieldView> const& fields,
+                       std::vector<size_t> const&    group,
+                       Config const&                 c) {
+    auto const& first = fields[group.front()];
+    auto const  order =
+        first.strides[0] <= first.strides[2] ? MemoryOrder::F : MemoryOrder::C;
+
+    return dispatch_dtype(first.dtype, [&](auto tag) {
+        using T = decltype(tag);
+
+        StridedReader<T> reader;
+
+        for (size_t i : group) {
+            reader.bases.push_back(static_cast<T const*>(fields[i].data));
+            reader.strides.push_back(fields[i].strides);
+        }
+
+        return build_open_vdb_fields(dims, group.size(), reader, c, order);
+    });
+}
+
+} // namespace
+
+openvdb::GridPtrVec convert_file(Config const& config) {
+    install_plugins();
+
+    if (config.requested_plugin.size()) {
+        auto iter = plugin_map.find(config.requested_plugin);
+
+        if (iter == plugin_map.end()) {
+            std::cerr << "Unknown plugin requested!\n";
+            return {};
+        }
+
+        return iter->second(config);
+    }
+
+    for (auto const& p : plugins) {
+        if (p.recognized(config.input_path)) return p.convert(config);
+    }
+
+    return {};
+}
+
+openvdb::GridPtrVec convert_fields(std::array<size_t, 3>         dims,
+                                   std::vector<FieldView> const& fields,
+                                   Config const&                 config) {
+    PhaseTimer timer(config, "convert");
+
+    // indices of the fields of each dtype
+    std::vector<std::vector<size_t>> groups;
+
+    for (size_t i = 0; i < fields.size(); i++) {
+        auto iter = std::find_if(groups.begin(), groups.end(), [&](auto& g) {
+            return fields[g.front()].dtype == fields[i].dtype;
+        });
+
+        if (iter == groups.end()) {
+            groups.push_back({ i });
+        } else {
+            iter->push_back(i);
+        }
+    }
+
+    openvdb::GridPtrVec ret(fields.size());
+
+    for (auto const& group : groups) {
+        auto grids = build_group(dims, fields, group, config);
+
+        for (size_t f = 0; f < grids.size(); f++) {
+            grids[f]->setName(fields[group[f]].name);
+            ret[group[f]] = grids[f];
+        }
+    }
+
+    add_lod_grids(ret, config);
+
+    timer.add_grids(ret);
+
+    return ret;
+}
@@ -0,0 +1,52 @@
+#ifndef MAKEOPENVDB_H
+#define MAKEOPENVDB_H
+
+#include "common.h"
+
+#include <openvdb/openvdb.h>
+
+#include <array>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Entry points of the makeopenvdb library, for converting without going
+// through the command line tool. openvdb::initialize() must have been called.
+
+// Convert config.input_path with the first plugin that recognizes it, or with
+// config.requested_plugin if set
+openvdb::GridPtrVec convert_file(Config const& config);
+
+// Element type of a caller owned buffer
+enum class DType {
+    FLOAT16,
+    FLOAT32,
+    FLOAT64,
+    INT8,
+    UINT8,
+    INT16,
+    UINT16,
+    INT32,
+};
+
+// A dense field in caller owned memory. Strides are in elements, so voxel
+// (x, y, z) is at data[x * strides[0] + y * strides[1] + z * strides[2]].
+// This covers C and Fortran order, and fields interleaved in one buffer.
+struct FieldView {
+    std::string           name;
+    void const*           data;
+    DType                 dtype;
+    std::array<size_t, 3> strides;
+};
+
+// Build one grid per field over a box of dims voxels, in field order and
+// followed by any LOD grids the config asks for, reading the caller's
+// buffers in place. Fields of one dtype are built in a single pass. Sparse,
+// prune, thread, ROI and stride settings come from the config; settings
+// about reading files are not used. The buffers must stay alive until this
+// returns.
+openvdb::GridPtrVec convert_fields(std::array<size_t, 3>         dims,
+                                   std::vector<FieldView> const& fields,
+                                   Config const&                 config);
+
+#endif // MAKEOPENVDB_H
@@ -0,0 +1,63 @@
+#include "progress.h"
+
+#include <cstdio>
+#include <iostream>
+
+ProgressReporter::ProgressReporter(uint64_t total, double interval_s)
+    : m_total(total),
+      m_start(std::chrono::steady_clock::now()),
+      m_interval(interval_s),
+      m_thread([this]() { run(); }) { }
+
+ProgressReporter::~ProgressReporter() {
+    {
+        std::scoped_lock lock(m_mutex);
+        m_stop = true;
+    }
+
+    m_wake.notify_one();
+    m_thread.join();
+
+    print();
+}
+
+void ProgressReporter::print() {
+    uint64_t done = m_done.load(std::memory_order_relaxed);
+
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - m_start;
+
+    double fraction = m_total ? double(done) / m_total : 1.0;
+    double rate     = elapsed.count() > 0 ? done / elapsed.count() : 0;
+
+    char line[128];
+
+    if (rate > 0 && done < m_total) {
+        auto eta = uint64_t((m_total - done) / rate);
+
+        std::snprintf(line,
+                      sizeof(line),
+                      "Progress: %5.1f%% %.1f Mvox/s ETA %02u:%02u:%02u",
+                      100 * fraction,
+                      rate * 1e-6,
+                      unsigned(eta / 3600),
+                      unsigned(eta / 60 % 60),
+                      unsigned(eta % 60));
+    } else {
+        std::snprintf(line,
+                      sizeof(line),
+                      "Progress: %5.1f%% %.1f Mvox/s",
+                      100 * fraction,
+                      rate * 1e-6);
+    }
+
+    std::cout << line << std::endl;
+}
+
+void ProgressReporter::run() {
+    std::unique_lock lock(m_mutex);
+
+    while (!m_wake.wait_for(lock, m_interval, [this]() { return m_stop; })) {
+        print();
+    }
+}
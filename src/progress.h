@@ -0,0 +1,42 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+// Progress of a long build. Workers report finished voxels once per chunk
+// with a relaxed atomic add, and a reporter thread prints the percentage,
+// rate and ETA at most once per interval, so the build loop never waits on
+// output.
+class ProgressReporter {
+    std::atomic<uint64_t> m_done { 0 };
+    uint64_t              m_total;
+
+    std::chrono::steady_clock::time_point m_start;
+    std::chrono::duration<double>         m_interval;
+
+    std::mutex              m_mutex;
+    std::condition_variable m_wake;
+    bool                    m_stop = false;
+    std::thread             m_thread;
+
+    void print();
+    void run();
+
+public:
+    explicit ProgressReporter(uint64_t total, double interval_s = 1.0);
+    ~ProgressReporter();
+
+    ProgressReporter(ProgressReporter const&) = delete;
+    ProgressReporter& operator=(ProgressReporter const&) = delete;
+
+    void add(uint64_t voxels) {
+        m_done.fetch_add(voxels, std::memory_order_relaxed);
+    }
+};
+
+#endif // PROGRESS_H
@@ -0,0 +1,663 @@
+#include "rawplugin.h"
+
+#include "binary_source.h"
+#include "stats.h"
+#include "threading.h"
+#include "vdb_tools.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <unordered_map>
+
+namespace {
+
+constexpr bool HOST_BIG_ENDIAN = __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__;
+
+// A dense volume inside a file, as described by its header. Channels are
+// interleaved per voxel, or with planar set, stored one whole volume after
+// another. When the header gives the world space step along each axis, that
+// is used instead of spacing.
+struct RawVolume {
+    fs::path              data_file;
+    size_t                offset   = 0;
+    std::array<size_t, 3> dims     = { 1, 1, 1 };
+    size_t                channels = 1;
+    bool                  planar   = false;
+    MemoryOrder           order    = MemoryOrder::F;
+    ElementType           type     = float();
+    bool                  swap     = false;
+    std::array<double, 3> spacing  = { 1, 1, 1 };
+    std::array<double, 3> origin   = { 0, 0, 0 };
+
+    std::optional<std::array<std::array<double, 3>, 3>> axes;
+
+    size_t element_size() const {
+        return std::visit([](auto tag) { return sizeof(tag); }, type);
+    }
+
+    size_t byte_count() const {
+        return dims[0] * dims[1] * dims[2] * channels * element_size();
+    }
+};
+
+std::string_view trim(std::string_view s) {
+    auto first = s.find_first_not_of(" \t\r");
+    if (first == std::string_view::npos) return {};
+
+    auto last = s.find_last_not_of(" \t\r");
+    return s.substr(first, last - first + 1);
+}
+
+// Whitespace or comma separated numbers, ignoring brackets
+template <class T>
+std::vector<T> parse_list(std::string_view s) {
+    std::string clean(s);
+
+    std::replace_if(
+        clean.begin(),
+        clean.end(),
+        [](char ch) { return ch == ',' || ch == '(' || ch == ')'; },
+        ' ');
+
+    std::istringstream is(clean);
+    std::vector<T>     ret;
+
+    T value;
+    while (is >> value) {
+        ret.push_back(value);
+    }
+
+    return ret;
+}
+
+// Most entries an axis may have to be taken as channels
+constexpr size_t MAX_CHANNELS = 16;
+
+// Fill dims from a shape with the fastest varying axis first. Of four axes,
+// the shorter of the fastest (channels interleaved per voxel) and the
+// slowest (planar channels) is taken as channels, if it is short enough.
+bool set_shape(RawVolume& v, std::vector<size_t> shape) {
+    if (shape.size() == 4) {
+        size_t const fast = shape.front();
+        size_t const slow = shape.back();
+
+        if (std::min(fast, slow) > MAX_CHANNELS) {
+            std::cerr << "Neither end of the 4 dimensional shape has at most "
+                      << MAX_CHANNELS << " entries to use as channels.\n";
+            return false;
+        }
+
+        if (fast <= slow) {
+            v.channels = fast;
+            shape.erase(shape.begin());
+        } else {
+            v.channels = slow;
+            v.planar   = true;
+            shape.pop_back();
+        }
+
+        std::cout << "Taking the " << (v.planar ? "slowest" : "fastest")
+                  << " axis as " << v.channels << " channels" << std::endl;
+    }
+
+    if (shape.empty() || shape.size() > 3) {
+        std::cerr << "Only 1 to 3 dimensional volumes are supported.\n";
+        return false;
+    }
+
+    std::copy(shape.begin(), shape.end(), v.dims.begin());
+
+    return true;
+}
+
+// NumPy: magic, version, header length, then a Python dict literal such as
+// {'descr': '<f4', 'fortran_order': False, 'shape': (64, 64, 64), }
+std::optional<RawVolume> parse_npy(fs::path const& path) {
+    std::ifstream is(path, std::ios::binary);
+
+    unsigned char prefix[12];
+
+    if (!is.read(reinterpret_cast<char*>(prefix), 10) ||
+        std::memcmp(prefix, "\x93NUMPY", 6) != 0) {
+        std::cerr << "Not a NumPy file.\n";
+        return std::nullopt;
+    }
+
+    size_t header_len = prefix[8] | (prefix[9] << 8);
+    size_t start      = 10;
+
+    if (prefix[6] >= 2) {
+        if (!is.read(reinterpret_cast<char*>(prefix + 10), 2)) {
+            return std::nullopt;
+        }
+
+        header_len |= (size_t(prefix[10]) << 16) | (size_t(prefix[11]) << 24);
+        start = 12;
+    }
+
+    std::string header(header_len, '\0');
+
+    if (!is.read(header.data(), header_len)) return std::nullopt;
+
+    auto value_of = [&](std::string_view key) -> std::string_view {
+        auto pos = header.find(std::string("'") + std::string(key) + "'");
+        if (pos == std::string::npos) return {};
+
+        pos = header.find(':', pos);
+        return trim(std::string_view(header).substr(pos + 1));
+    };
+
+    RawVolume ret;
+    ret.data_file = path;
+    ret.offset    = start + header_len;
+
+    // a quoted string such as '<f4'
+    auto descr = value_of("descr");
+
+    if (descr.size() < 3 || descr.front() != '\'' ||
+        descr.find('\'', 1) == std::string_view::npos) {
+        std::cerr << "Unsupported NumPy dtype " << descr << ".\n";
+        return std::nullopt;
+    }
+
+    descr = descr.substr(1, descr.find('\'', 1) - 1);
+
+    static std::unordered_map<std::string_view, ElementType> const types = {
+        { "f2", HalfBits() }, { "f4", float() },    { "f8", double() },
+        { "i1", int8_t() },   { "u1", uint8_t() },  { "i2", int16_t() },
+        { "u2", uint16_t() }, { "i4", int32_t() },
+    };
+
+    auto iter = descr.empty() ? types.end() : types.find(descr.substr(1));
+
+    if (iter == types.end()) {
+        std::cerr << "Unsupported NumPy dtype " << descr << ".\n";
+        return std::nullopt;
+    }
+
+    ret.type = iter->second;
+    ret.swap = (descr[0] == '>' && !HOST_BIG_ENDIAN) ||
+               (descr[0] == '<' && HOST_BIG_ENDIAN);
+
+    bool fortran = value_of("fortran_order").substr(0, 4) == "True";
+
+    auto shape_text = value_of("shape");
+    auto shape      = parse_list<size_t>(
+        shape_text.substr(0, shape_text.find(')') + 1));
+
+    // C order puts the fastest axis last
+    if (!fortran) std::reverse(shape.begin(), shape.end());
+
+    if (!set_shape(ret, shape)) return std::nullopt;
+
+    if (!fortran) {
+        size_t spatial = std::min<size_t>(shape.size(), 3);
+
+        std::reverse(ret.dims.begin(), ret.dims.begin() + spatial);
+        ret.order = MemoryOrder::C;
+    }
+
+    return ret;
+}
+
+std::optional<ElementType> nrrd_type(std::string_view name) {
+    static std::unordered_map<std::string_view, ElementType> const types = {
+        { "float", float() },
+        { "double", double() },
+        { "signed char", int8_t() },
+        { "int8", int8_t() },
+        { "int8_t", int8_t() },
+        { "uchar", uint8_t() },
+        { "unsigned char", uint8_t() },
+        { "uint8", uint8_t() },
+        { "uint8_t", uint8_t() },
+        { "short", int16_t() },
+        { "short int", int16_t() },
+        { "signed short", int16_t() },
+        { "signed short int", int16_t() },
+        { "int16", int16_t() },
+        { "int16_t", int16_t() },
+        { "ushort", uint16_t() },
+        { "unsigned short", uint16_t() },
+        { "unsigned short int", uint16_t() },
+        { "uint16", uint16_t() },
+        { "uint16_t", uint16_t() },
+        { "int", int32_t() },
+        { "signed int", int32_t() },
+        { "int32", int32_t() },
+        { "int32_t", int32_t() },
+    };
+
+    auto iter = types.find(name);
+
+    if (iter == types.end()) return std::nullopt;
+
+    return iter->second;
+}
+
+// NRRD: a magic line, then "field: value" lines up to a blank line. The data
+// follows the blank line, or lives in a detached data file.
+std::optional<RawVolume> parse_nrrd(fs::path const& path) {
+    std::ifstream is(path, std::ios::binary);
+
+    std::string line;
+
+    if (!std::getline(is, line) || line.rfind("NRRD", 0) != 0) {
+        std::cerr << "Not a NRRD file.\n";
+        return std::nullopt;
+    }
+
+    std::unordered_map<std::string, std::string> fields;
+
+    while (std::getline(is, line)) {
+        auto l = trim(line);
+
+        if (l.empty()) break;
+        if (l[0] == '#') continue;
+
+        auto colon = l.find(": ");
+
+        // key:=value pairs carry no layout
+        if (colon == std::string_view::npos) continue;
+
+        fields[std::string(l.substr(0, colon))] =
+            std::string(trim(l.substr(colon + 2)));
+    }
+
+    RawVolume ret;
+    ret.data_file = path;
+    ret.offset    = is.tellg();
+    ret.order     = MemoryOrder::F;
+
+    if (fields["encoding"] != "raw") {
+        std::cerr << "Only raw NRRD encoding is supported.\n";
+        return std::nullopt;
+    }
+
+    auto type = nrrd_type(fields["type"]);
+
+    if (!type) {
+        std::cerr << "Unsupported NRRD type " << fields["type"] << ".\n";
+        return std::nullopt;
+    }
+
+    ret.type = *type;
+    ret.swap = (fields["endian"] == "big") != HOST_BIG_ENDIAN &&
+               ret.element_size() > 1;
+
+    if (!set_shape(ret, parse_list<size_t>(fields["sizes"]))) {
+        return std::nullopt;
+    }
+
+    auto data_file = fields.count("data file") ? fields["data file"]
+                                               : fields["datafile"];
+
+    if (!data_file.empty()) {
+        ret.data_file = path.parent_path() / data_file;
+
+        auto const& text = fields["byte skip"];
+
+        char*     end       = nullptr;
+        long long byte_skip = std::strtoll(text.c_str(), &end, 10);
+
+        if (!text.empty() &&
+            (end == text.c_str() || *end != '\0' || byte_skip < -1)) {
+            std::cerr << "Bad NRRD byte skip " << text << ".\n";
+            return std::nullopt;
+        }
+
+        // -1 places the data at the end of the file
+        if (byte_skip >= 0) {
+            ret.offset = byte_skip;
+        } else {
+            std::error_code ec;
+            auto            size = fs::file_size(ret.data_file, ec);
+
+            if (ec || size < ret.byte_count()) {
+                std::cerr << "Data file " << ret.data_file
+                          << " is smaller than its header describes.\n";
+                return std::nullopt;
+            }
+
+            ret.offset = size - ret.byte_count();
+        }
+    }
+
+    // spacings, or space directions; either may have an entry for an
+    // interleaved channel axis, which comes first
+    size_t const skip = ret.channels > 1 && !ret.planar ? 1 : 0;
+
+    if (fields.count("spacings")) {
+        auto spacings = parse_list<double>(fields["spacings"]);
+
+        for (size_t i = 0; i + skip < spacings.size() && i < 3; i++) {
+            ret.spacing[i] = spacings[i + skip];
+        }
+    } else if (fields.count("space directions")) {
+        std::istringstream directions(fields["space directions"]);
+        std::string        vector;
+
+        std::array<std::array<double, 3>, 3> axes = { { { 1, 0, 0 },
+                                                        { 0, 1, 0 },
+                                                        { 0, 0, 1 } } };
+
+        bool   aligned = true;
+        size_t axis    = 0;
+
+        // a channel axis has "none" in place of a vector
+        while (directions >> vector && axis < 3) {
+            if (vector == "none") continue;
+
+            auto d = parse_list<double>(vector);
+
+            for (size_t j = 0; j < 3; j++) {
+                axes[axis][j] = j < d.size() ? d[j] : 0;
+
+                aligned &= j == axis ? axes[axis][j] > 0 : axes[axis][j] == 0;
+            }
+
+            ret.spacing[axis] = std::sqrt(axes[axis][0] * axes[axis][0] +
+                                          axes[axis][1] * axes[axis][1] +
+                                          axes[axis][2] * axes[axis][2]);
+            axis++;
+        }
+
+        if (!aligned) {
+            std::cout << "Space directions are rotated or flipped; they are "
+                         "kept in the grid transform"
+                      << std::endl;
+        }
+
+        ret.axes = axes;
+    }
+
+    if (fields.count("space origin")) {
+        auto origin = parse_list<double>(fields["space origin"]);
+
+        for (size_t i = 0; i < origin.size() && i < 3; i++) {
+            ret.origin[i] = origin[i];
+        }
+    }
+
+    return ret;
+}
+
+// MetaImage: "Key = Value" lines, ending with ElementDataFile. LOCAL data
+// follows that line.
+std::optional<RawVolume> parse_mhd(fs::path const& path) {
+    std::ifstream is(path, std::ios::binary);
+
+    std::unordered_map<std::string, std::string> fields;
+
+    std::string line;
+
+    while (std::getline(is, line)) {
+        auto eq = line.find('=');
+
+        if (eq == std::string::npos) continue;
+
+        auto key   = std::string(trim(std::string_view(line).substr(0, eq)));
+        auto value = std::string(trim(std::string_view(line).substr(eq + 1)));
+
+        fields[key] = value;
+
+        if (key == "ElementDataFile") break;
+    }
+
+    RawVolume ret;
+    ret.order = MemoryOrder::F;
+
+    if (fields["CompressedData"] == "True") {
+        std::cerr << "Compressed MetaImage data is not supported.\n";
+        return std::nullopt;
+    }
+
+    static std::unordered_map<std::string, ElementType> const types = {
+        { "MET_FLOAT", float() },    { "MET_DOUBLE", double() },
+        { "MET_CHAR", int8_t() },    { "MET_UCHAR", uint8_t() },
+        { "MET_SHORT", int16_t() },  { "MET_USHORT", uint16_t() },
+        { "MET_INT", int32_t() },
+    };
+
+    auto type = types.find(fields["ElementType"]);
+
+    if (type == types.end()) {
+        std::cerr << "Unsupported MetaImage type " << fields["ElementType"]
+                  << ".\n";
+        return std::nullopt;
+    }
+
+    ret.type = type->second;
+
+    if (!set_shape(ret, parse_list<size_t>(fields["DimSize"]))) {
+        return std::nullopt;
+    }
+
+    if (fields.count("ElementNumberOfChannels")) {
+        ret.channels = std::stoul(fields["ElementNumberOfChannels"]);
+    }
+
+    auto msb = fields.count("BinaryDataByteOrderMSB")
+                   ? fields["BinaryDataByteOrderMSB"]
+                   : fields["ElementByteOrderMSB"];
+
+    ret.swap = (msb == "True") != HOST_BIG_ENDIAN && ret.element_size() > 1;
+
+    auto spacing = parse_list<double>(fields.count("ElementSpacing")
+                                          ? fields["ElementSpacing"]
+                                          : fields["ElementSize"]);
+
+    for (size_t i = 0; i < spacing.size() && i < 3; i++) {
+        ret.spacing[i] = spacing[i];
+    }
+
+    for (auto key : { "Offset", "Origin", "Position" }) {
+        if (!fields.count(key)) continue;
+
+        auto origin = parse_list<double>(fields[key]);
+
+        for (size_t i = 0; i < origin.size() && i < 3; i++) {
+            ret.origin[i] = origin[i];
+        }
+
+        break;
+    }
+
+    auto const& data_file = fields["ElementDataFile"];
+
+    if (data_file.empty()) {
+        std::cerr << "MetaImage header has no ElementDataFile.\n";
+        return std::nullopt;
+    }
+
+    if (data_file == "LOCAL") {
+        ret.data_file = path;
+        ret.offset    = is.tellg();
+        return ret;
+    }
+
+    ret.data_file = path.parent_path() / data_file;
+
+    // -1 places the data at the end of the file
+    long header_size =
+        fields.count("HeaderSize") ? std::stol(fields["HeaderSize"]) : 0;
+
+    if (header_size >= 0) {
+        ret.offset = header_size;
+    } else if (fs::file_size(ret.data_file) >= ret.byte_count()) {
+        ret.offset = fs::file_size(ret.data_file) - ret.byte_count();
+    }
+
+    return ret;
+}
+
+std::optional<RawVolume> parse_header(fs::path const& path) {
+    auto ext = path.extension();
+
+    if (ext == ".npy") return parse_npy(path);
+    if (ext == ".nrrd" || ext == ".nhdr") return parse_nrrd(path);
+    return parse_mhd(path);
+}
+
+// The payload copied into memory, for data that has to be byte swapped or is
+// not aligned for its type in the file
+std::unique_ptr<MemData> load_payload(RawVolume const& v, Config const& c) {
+    FileHandle file;
+    file.fd = open(v.data_file.c_str(), O_RDONLY);
+
+    if (file.fd < 0) return nullptr;
+
+    size_t const bytes = v.byte_count();
+
+    auto ret        = std::make_unique<MemData>();
+    ret->data       = std::unique_ptr<std::byte[]>(new std::byte[bytes]);
+    ret->byte_count = bytes;
+
+    first_touch(ret->data.get(), bytes, c);
+
+    if (!pread_all(file.fd, ret->data.get(), bytes, v.offset)) return nullptr;
+
+    if (v.swap) {
+        size_t const size = v.element_size();
+
+        for (size_t i = 0; i < bytes; i += size) {
+            std::reverse(ret->data.get() + i, ret->data.get() + i + size);
+        }
+    }
+
+    return ret;
+}
+
+template <class T>
+FloatGrids
+convert_volume(RawVolume const& v, std::byte const* payload, Config const& c) {
+    size_t const voxels = v.dims[0] * v.dims[1] * v.dims[2];
+    size_t const stride = v.planar ? 1 : v.channels;
+
+    std::vector<T const*> bases;
+
+    for (size_t ch = 0; ch < v.channels; ch++) {
+        bases.push_back(reinterpret_cast<T const*>(payload) +
+                        (v.planar ? ch * voxels : ch));
+    }
+
+    return dispatch_order(v.order, [&](auto tag) {
+        constexpr MemoryOrder order = decltype(tag)::value;
+
+        auto reader = make_field_reader<T, order>(v.dims, bases, stride, c);
+
+        return build_open_vdb_fields(v.dims, v.channels, reader, c, order);
+    });
+}
+
+} // namespace
+
+RawPlugin::RawPlugin(Config const&) { }
+
+RawPlugin::~RawPlugin() { }
+
+bool RawPlugin::recognized(fs::path const& path) {
+    auto ext = path.extension();
+
+    return ext == ".npy" || ext == ".nrrd" || ext == ".nhdr" ||
+           ext == ".mhd" || ext == ".mha";
+}
+
+// The payload is mapped in place and read directly by the builder. It is
+// only copied when it must be byte swapped or is misaligned for its type.
+openvdb::GridPtrVec RawPlugin::convert(Config const& c) {
+    auto volume = parse_header(c.input_path);
+
+    if (!volume) return {};
+
+    auto const& v = *volume;
+
+    std::cout << "Volume " << v.dims[0] << " " << v.dims[1] << " " << v.dims[2]
+              << ", " << v.channels << " channel(s), " << v.element_size()
+              << " byte elements, "
+              << (v.order == MemoryOrder::C ? "C" : "F") << " order\n";
+
+    if (!fs::is_regular_file(v.data_file) ||
+        fs::file_size(v.data_file) < v.offset + v.byte_count()) {
+        std::cerr << "Data file " << v.data_file
+                  << " is smaller than its header describes.\n";
+        return {};
+    }
+
+    std::unique_ptr<MapData> mapped;
+    std::unique_ptr<MemData> loaded;
+    std::byte const*         payload = nullptr;
+
+    {
+        PhaseTimer timer(c, "read");
+        timer.add_bytes_read(v.byte_count());
+
+        mapped = map_file_to(v.data_file);
+
+        if (mapped) payload = mapped->begin() + v.offset;
+
+        bool aligned =
+            reinterpret_cast<uintptr_t>(payload) % v.element_size() == 0;
+
+        if (!mapped || v.swap || !aligned) {
+            std::cout << "Copying payload..." << std::endl;
+
+            mapped.reset();
+            loaded = load_payload(v, c);
+
+            if (!loaded) {
+                std::cerr << "Unable to read " << v.data_file << ".\n";
+                return {};
+            }
+
+            payload = loaded->begin();
+        }
+    }
+
+    auto grids = std::visit(
+        [&](auto tag) { return convert_volume<decltype(tag)>(v, payload, c); },
+        v.type);
+
+    std::string stem = c.input_path.stem().string();
+
+    // index to world, with the step along index axis i in row i
+    openvdb::Mat4d m = openvdb::Mat4d::identity();
+
+    for (size_t i = 0; i < 3; i++) {
+        for (size_t j = 0; j < 3; j++) {
+            if (v.axes) {
+                m[i][j] = (*v.axes)[i][j];
+            } else {
+                m[i][j] = i == j ? v.spacing[i] : 0;
+            }
+        }
+    }
+
+    m.postTranslate(openvdb::Vec3d(v.origin[0], v.origin[1], v.origin[2]));
+
+    openvdb::GridPtrVec ret;
+
+    for (size_t f = 0; f < grids.size(); f++) {
+        std::string name = stem;
+
+        if (grids.size() > 1) name += "_" + std::to_string(f);
+
+        auto iter = c.name_map.find(name);
+        if (iter != c.name_map.end()) name = iter->second;
+
+        grids[f]->setName(name);
+        // after any region of interest and stride mapping of the build
+        grids[f]->transform().postMult(m);
+
+        ret.push_back(grids[f]);
+    }
+
+    return ret;
+}
@@ -0,0 +1,20 @@
+#ifndef RAWPLUGIN_H
+#define RAWPLUGIN_H
+
+#include "common.h"
+
+#include <openvdb/openvdb.h>
+
+// Raw volumes whose shape, type and layout come from a header: NumPy .npy,
+// NRRD with raw encoding (.nrrd, .nhdr) and MetaImage (.mhd, .mha)
+class RawPlugin {
+public:
+    RawPlugin(Config const&);
+    ~RawPlugin();
+
+    static bool recognized(fs::path const&);
+
+    openvdb::GridPtrVec convert(Config const&);
+};
+
+#endif // RAWPLUGIN_H
@@ -0,0 +1,157 @@
+#include "stats.h"
+
+#include <sys/resource.h>
+#include <time.h>
+
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+namespace {
+
+double cpu_seconds(PhaseTimer::Clock clock) {
+    timespec ts;
+
+    clock_gettime(clock == PhaseTimer::Clock::THREAD ? CLOCK_THREAD_CPUTIME_ID
+                                                     : CLOCK_PROCESS_CPUTIME_ID,
+                  &ts);
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+uint64_t peak_rss_bytes() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    // kilobytes on Linux
+    return uint64_t(usage.ru_maxrss) * 1024;
+}
+
+std::string json_string(std::string const& str) {
+    std::ostringstream os;
+
+    os << '"';
+
+    for (char ch : str) {
+        switch (ch) {
+        case '"': os << "\\\""; break;
+        case '\\': os << "\\\\"; break;
+        case '\n': os << "\\n"; break;
+        case '\t': os << "\\t"; break;
+        default:
+            if (static_cast<unsigned char>(ch) < 0x20) {
+                os << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+                   << int(ch) << std::dec;
+            } else {
+                os << ch;
+            }
+        }
+    }
+
+    os << '"';
+
+    return os.str();
+}
+
+} // namespace
+
+StatsLog::StatsLog() : m_start(std::chrono::steady_clock::now()) { }
+
+double StatsLog::seconds_since_start() const {
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - m_start;
+    return elapsed.count();
+}
+
+void StatsLog::add(PhaseStats phase) {
+    std::scoped_lock lock(m_mutex);
+    m_phases.push_back(std::move(phase));
+}
+
+bool StatsLog::write_json(fs::path const& path) {
+    std::scoped_lock lock(m_mutex);
+
+    std::ofstream ofs(path);
+
+    if (!ofs) return false;
+
+    ofs << "[\n";
+
+    for (size_t i = 0; i < m_phases.size(); i++) {
+        auto const& p = m_phases[i];
+
+        ofs << "  {\"phase\": " << json_string(p.phase)
+            << ", \"input\": " << json_string(p.input)
+            << ", \"start_s\": " << p.start_s << ", \"wall_s\": " << p.wall_s
+            << ", \"cpu_s\": " << p.cpu_s
+            << ", \"peak_rss_bytes\": " << p.peak_rss_bytes;
+
+        if (p.bytes_read) ofs << ", \"bytes_read\": " << p.bytes_read;
+
+        if (p.bytes_written) {
+            ofs << ", \"bytes_written\": " << p.bytes_written;
+        }
+
+        if (p.voxels) {
+            ofs << ", \"voxels\": " << p.voxels;
+
+            if (p.wall_s > 0) {
+                ofs << ", \"voxels_per_s\": " << p.voxels / p.wall_s;
+            }
+        }
+
+        if (!p.grids.empty()) {
+            ofs << ", \"grids\": [";
+
+            for (size_t g = 0; g < p.grids.size(); g++) {
+                auto const& grid = p.grids[g];
+
+                if (g) ofs << ", ";
+
+                ofs << "{\"name\": " << json_string(grid.name)
+                    << ", \"mem_bytes\": " << grid.mem_bytes
+                    << ", \"active_voxels\": " << grid.active_voxels << "}";
+            }
+
+            ofs << "]";
+        }
+
+        ofs << "}" << (i + 1 < m_phases.size() ? "," : "") << "\n";
+    }
+
+    ofs << "]\n";
+
+    return bool(ofs);
+}
+
+PhaseTimer::PhaseTimer(Config const& c, std::string phase, Clock clock)
+    : m_log(c.stats.get()), m_clock(clock) {
+    if (!m_log) return;
+
+    m_stats.phase   = std::move(phase);
+    m_stats.input   = c.input_path.string();
+    m_stats.start_s = m_log->seconds_since_start();
+    m_cpu_start     = cpu_seconds(m_clock);
+}
+
+PhaseTimer::~PhaseTimer() {
+    if (!m_log) return;
+
+    m_stats.wall_s         = m_log->seconds_since_start() - m_stats.start_s;
+    m_stats.cpu_s          = cpu_seconds(m_clock) - m_cpu_start;
+    m_stats.peak_rss_bytes = peak_rss_bytes();
+
+    m_log->add(std::move(m_stats));
+}
+
+void PhaseTimer::add_grids(openvdb::GridPtrVec const& grids) {
+    if (!m_log) return;
+
+    for (auto const& grid : grids) {
+        if (!grid) continue;
+
+        m_stats.grids.push_back({ grid->getName(),
+                                  grid->memUsage(),
+                                  grid->activeVoxelCount() });
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "common.h"
+
+#include <openvdb/openvdb.h>
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct GridStats {
+    std::string name;
+    uint64_t    mem_bytes;
+    uint64_t    active_voxels;
+};
+
+struct PhaseStats {
+    std::string phase;
+    std::string input;
+    double      start_s;
+    double      wall_s;
+    double      cpu_s;
+    uint64_t    peak_rss_bytes;
+    uint64_t    bytes_read    = 0;
+    uint64_t    bytes_written = 0;
+    uint64_t    voxels        = 0;
+
+    std::vector<GridStats> grids;
+};
+
+// Phase records for --stats. Records can be added from any thread, and are
+// written as a JSON array once the run is done.
+class StatsLog {
+    std::mutex                            m_mutex;
+    std::chrono::steady_clock::time_point m_start;
+    std::vector<PhaseStats>               m_phases;
+
+public:
+    StatsLog();
+
+    double seconds_since_start() const;
+
+    void add(PhaseStats phase);
+
+    bool write_json(fs::path const& path);
+};
+
+// Records a phase from construction to destruction, if stats are enabled.
+// THREAD measures the CPU time of the calling thread only, for phases that
+// run as one of many parallel tasks.
+class PhaseTimer {
+public:
+    enum class Clock { PROCESS, THREAD };
+
+private:
+    StatsLog*  m_log = nullptr;
+    Clock      m_clock;
+    double     m_cpu_start = 0;
+    PhaseStats m_stats;
+
+public:
+    PhaseTimer(Config const& c,
+               std::string   phase,
+               Clock         clock = Clock::PROCESS);
+    ~PhaseTimer();
+
+    PhaseTimer(PhaseTimer const&) = delete;
+    PhaseTimer& operator=(PhaseTimer const&) = delete;
+
+    bool enabled() const { return m_log; }
+
+    void add_bytes_read(uint64_t bytes) { m_stats.bytes_read += bytes; }
+    void add_bytes_written(uint64_t bytes) { m_stats.bytes_written += bytes; }
+    void add_voxels(uint64_t voxels) { m_stats.voxels += voxels; }
+
+    void add_grids(openvdb::GridPtrVec const& grids);
+
+    template <class GridPtr>
+    void add_grids(std::vector<GridPtr> const& grids) {
+        if (!m_log) return;
+        add_grids(openvdb::GridPtrVec(grids.begin(), grids.end()));
+    }
+};
+
+#endif // STATS_H
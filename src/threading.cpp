@@ -0,0 +1,109 @@
+#include "threading.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <tbb/blocked_range.h>
+#include <tbb/info.h>
+#include <tbb/parallel_for.h>
+#include <tbb/task_arena.h>
+#include <tbb/task_scheduler_observer.h>
+
+#include <atomic>
+#include <iostream>
+#include <vector>
+
+// Pins each thread that joins the TBB arena to the next allowed CPU
+class PinningObserver : public tbb::task_scheduler_observer {
+    std::vector<int>    m_cpus;
+    std::atomic<size_t> m_next { 0 };
+
+public:
+    PinningObserver() {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &set)) m_cpus.push_back(cpu);
+            }
+        }
+
+        if (!m_cpus.empty()) observe(true);
+    }
+
+    ~PinningObserver() override { observe(false); }
+
+    size_t cpu_count() const { return m_cpus.size(); }
+
+    void on_scheduler_entry(bool) override {
+        // threads enter the arena many times; pin each only once
+        thread_local bool pinned = false;
+
+        if (pinned) return;
+
+        pinned = true;
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(m_cpus[m_next++ % m_cpus.size()], &set);
+
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+};
+
+ThreadSettings::ThreadSettings(Config const& c) {
+    if (c.use_threads && c.thread_limit > 0) {
+        m_limit.emplace(tbb::global_control::max_allowed_parallelism,
+                        c.thread_limit);
+    }
+
+    if (c.pin_threads) m_pinning = std::make_unique<PinningObserver>();
+}
+
+ThreadSettings::~ThreadSettings() = default;
+
+void ThreadSettings::report(Config const& c) const {
+    std::cout << "Threads: " << thread_count(c);
+
+    if (!c.use_threads) {
+        std::cout << " (serial)";
+    } else if (m_limit) {
+        std::cout << " (limited)";
+    }
+
+    std::cout << ", grain " << c.grain_size;
+
+    if (m_pinning) {
+        std::cout << ", pinned over " << m_pinning->cpu_count() << " cpus";
+    }
+
+    if (c.numa_first_touch) {
+        std::cout << ", NUMA first touch over "
+                  << tbb::info::numa_nodes().size() << " node(s)";
+    }
+
+    std::cout << std::endl;
+}
+
+int thread_count(Config const& c) {
+    if (!c.use_threads) return 1;
+
+    return tbb::global_control::active_value(
+        tbb::global_control::max_allowed_parallelism);
+}
+
+void first_touch(std::byte* data, size_t size, Config const& c) {
+    if (!c.numa_first_touch) return;
+
+    size_t const page  = sysconf(_SC_PAGESIZE);
+    size_t const pages = (size + page - 1) / page;
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, pages, 64),
+                      [&](auto const& range) {
+                          for (auto p = range.begin(); p != range.end(); ++p) {
+                              data[p * page] = std::byte(0);
+                          }
+                      });
+}
@@ -0,0 +1,41 @@
+#ifndef THREADING_H
+#define THREADING_H
+
+#include "common.h"
+
+#include <tbb/global_control.h>
+
+#include <cstddef>
+#include <memory>
+#include <optional>
+
+class PinningObserver;
+
+// Process wide thread settings from the config: a cap on TBB workers, and
+// optionally pinning each worker to its own core. Held for the whole run.
+class ThreadSettings {
+    std::optional<tbb::global_control> m_limit;
+    std::unique_ptr<PinningObserver>   m_pinning;
+
+public:
+    explicit ThreadSettings(Config const&);
+    ~ThreadSettings();
+
+    ThreadSettings(ThreadSettings const&) = delete;
+    ThreadSettings& operator=(ThreadSettings const&) = delete;
+
+    // Print the applied settings
+    void report(Config const&) const;
+};
+
+// Number of threads a parallel phase will use under the config
+int thread_count(Config const&);
+
+// Touch every page of a freshly allocated buffer from the worker threads.
+// With first touch placement the pages are then spread over the NUMA nodes
+// of the workers, rather than all placed on the allocating thread's. Which
+// worker later reads a page is up to the scheduler, so this balances memory
+// bandwidth across nodes but does not make reads local.
+void first_touch(std::byte* data, size_t size, Config const& c);
+
+#endif // THREADING_H
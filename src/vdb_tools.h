@@ -2,16 +2,26 @@
 #define VDB_TOOLS_H
 
 #include "common.h"
+#include "progress.h"
+#include "stats.h"
+#include "threading.h"
 
+#include <algorithm>
+#include <array>
+#include <cmath>
 #include <iostream>
-#include <list>
-#include <mutex>
+#include <limits>
+#include <memory>
 #include <optional>
 #include <type_traits>
+#include <vector>
 
 #include <openvdb/openvdb.h>
-#include <openvdb/tools/Composite.h>
 #include <openvdb/tools/Prune.h>
+#include <openvdb/tree/LeafManager.h>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
 
 template <typename... T>
 struct dependent_false {
@@ -28,116 +38,1306 @@ Pair<T> make_pair(T a, T b) {
     return Pair<T> { a, b };
 }
 
-template <class Reader, class IterA>
-auto vdb_chunk(Reader const& a,
-               Config const& c,
-               Pair<size_t>  xs,
-               Pair<size_t>  ys,
-               Pair<IterA>   zs) {
-    auto sub_grid = openvdb::FloatGrid::create();
-    auto accessor = sub_grid->getAccessor();
+// Background of the grids being built. Zero unless a sparse build asked for
+// something else.
+inline float build_background(Config const& c) {
+    return c.sparse_background.value_or(0.0f);
+}
+
+// In a sparse build, values within tolerance of the background are never
+// inserted.
+inline bool is_background(float value, Config const& c) {
+    return c.sparse_background &&
+           std::abs(value - *c.sparse_background) <= c.sparse_tolerance;
+}
+
+// Loop axes, outermost first, for walking a source stored in the given order.
+// The innermost loop then follows memory.
+inline std::array<size_t, 3> traversal_axes(MemoryOrder order) {
+    if (order == MemoryOrder::C) return { 0, 1, 2 };
+    return { 2, 1, 0 };
+}
+
+// Readers are called with global voxel coordinates. A single field reader
+// returns float, or std::optional<float> with nullopt for voxels that should
+// stay inactive. A multi-field reader has the form
+//
+//     bool (size_t x, size_t y, size_t z, float* out)
+//
+// writes one value per field to out, and returns false to leave the voxel
+// inactive. All fields of a build share one active topology.
+//
+// Multi-field readers over dense sources may also provide
+//
+//     void read_row(size_t x, size_t y, size_t z, size_t axis, size_t count,
+//                   float* out)
+//
+// which reads count voxels starting at (x, y, z) along axis, field by field
+// (out[f * count + i]). The engines then convert a whole innermost row per
+// call; rows along the storage-fast axis are contiguous in memory.
+
+template <class Reader, class = void>
+struct has_read_row : std::false_type { };
+
+template <class Reader>
+using read_row_t = decltype(std::declval<Reader const&>().read_row(
+    size_t(), size_t(), size_t(), size_t(), size_t(), (float*)nullptr));
+
+template <class Reader>
+struct has_read_row<Reader, std::void_t<read_row_t<Reader>>>
+    : std::true_type { };
+
+// Adapt a single field reader to the multi-field form
+template <class Reader>
+auto as_fields(Reader const& a) {
+    return [&a](size_t x, size_t y, size_t z, float* out) -> bool {
+        using RetType = std::invoke_result_t<Reader, size_t, size_t, size_t>;
+
+        if constexpr (std::is_same_v<RetType, std::optional<float>>) {
+            auto value = a(x, y, z);
+
+            if (!value.has_value()) return false;
+
+            *out = value.value();
+            return true;
+        } else if constexpr (std::is_same_v<RetType, float>) {
+            *out = a(x, y, z);
+            return true;
+        } else {
+            static_assert(dependent_false<RetType>::value,
+                          "Unknown Reader return type");
+        }
+    };
+}
+
+// False if, in a sparse build, every field of a voxel is background
+inline bool
+keep_voxel(float const* values, size_t field_count, Config const& c) {
+    if (!c.sparse_background) return true;
+
+    for (size_t f = 0; f < field_count; f++) {
+        if (!is_background(values[f], c)) return true;
+    }
+
+    return false;
+}
+
+// Visit the voxels of one innermost-loop row, with p[axis] running over ks.
+// visit is called with the values of every field for each voxel that should
+// be active. scratch is reused between rows.
+template <class Reader, class Visit>
+void for_each_in_row(Reader const&          a,
+                     std::array<size_t, 3>& p,
+                     size_t                 axis,
+                     Pair<size_t>           ks,
+                     size_t                 field_count,
+                     Config const&          c,
+                     std::vector<float>&    scratch,
+                     Visit&&                visit) {
+    auto& k = p[axis];
+
+    if constexpr (has_read_row<Reader>::value) {
+        size_t count = ks.second - ks.first;
 
-    openvdb::Coord ijk;
+        scratch.resize(field_count * (count + 1));
+
+        float* row   = scratch.data();
+        float* voxel = row + field_count * count;
+
+        k = ks.first;
+
+        a.read_row(p[0], p[1], p[2], axis, count, row);
+
+        for (size_t n = 0; n < count; n++, k++) {
+            for (size_t f = 0; f < field_count; f++) {
+                voxel[f] = row[f * count + n];
+            }
+
+            if (keep_voxel(voxel, field_count, c)) visit(voxel);
+        }
+    } else {
+        scratch.resize(field_count);
+
+        float* voxel = scratch.data();
+
+        for (k = ks.first; k < ks.second; ++k) {
+            if (!a(p[0], p[1], p[2], voxel)) continue;
+
+            if (keep_voxel(voxel, field_count, c)) visit(voxel);
+        }
+    }
+}
+
+using FloatGrids = std::vector<openvdb::FloatGrid::Ptr>;
+
+inline FloatGrids make_grids(size_t field_count, Config const& c) {
+    FloatGrids ret;
+
+    for (size_t f = 0; f < field_count; f++) {
+        ret.push_back(openvdb::FloatGrid::create(build_background(c)));
+    }
+
+    return ret;
+}
+
+template <class Reader>
+FloatGrids vdb_chunk(Reader const& a,
+                     size_t        field_count,
+                     Config const& c,
+                     Pair<size_t>  xs,
+                     Pair<size_t>  ys,
+                     Pair<size_t>  zs,
+                     MemoryOrder   order) {
+    auto sub_grids = make_grids(field_count, c);
+
+    std::vector<openvdb::FloatGrid::Accessor> accessors;
+    accessors.reserve(field_count);
+
+    for (auto const& grid : sub_grids) {
+        accessors.push_back(grid->getAccessor());
+    }
 
-    int& x = ijk[0];
-    int& y = ijk[1];
-    int& z = ijk[2];
+    std::vector<float> scratch;
 
-    using RetType = std::invoke_result_t<Reader, size_t, size_t, size_t>;
+    std::array<Pair<size_t>, 3> const ranges = { xs, ys, zs };
 
-    for (z = zs.first; z != zs.second; ++z) {
-        for (y = ys.first; y < ys.second; ++y) {
-            for (x = xs.first; x < xs.second; ++x) {
+    auto const axes = traversal_axes(order);
 
-                if constexpr (std::is_same_v<RetType, std::optional<float>>) {
-                    auto value = a(x, y, z);
+    auto const& r0 = ranges[axes[0]];
+    auto const& r1 = ranges[axes[1]];
+    auto const& r2 = ranges[axes[2]];
 
-                    if (value.has_value()) {
-                        accessor.setValue(ijk, value.value());
+    std::array<size_t, 3> p;
+
+    auto& i = p[axes[0]];
+    auto& j = p[axes[1]];
+
+    for (i = r0.first; i < r0.second; ++i) {
+        for (j = r1.first; j < r1.second; ++j) {
+            for_each_in_row(a,
+                            p,
+                            axes[2],
+                            r2,
+                            field_count,
+                            c,
+                            scratch,
+                            [&](float const* v) {
+                                openvdb::Coord ijk(p[0], p[1], p[2]);
+
+                                for (size_t f = 0; f < field_count; f++) {
+                                    accessors[f].setValue(ijk, v[f]);
+                                }
+                            });
+        }
+    }
+    return sub_grids;
+}
+
+// Leaf-direct variant of vdb_chunk. The chunk is walked in leaf sized blocks,
+// each block is written straight into LeafNode value buffers and an active
+// mask, and the leaves are only attached to the trees once they hold active
+// voxels. Blocks and the voxels within them are both visited in source order.
+// In a sparse build a fully active block whose values agree within tolerance
+// becomes a tile instead of a leaf.
+template <class Reader>
+FloatGrids vdb_chunk_leaf(Reader const& a,
+                          size_t        field_count,
+                          Config const& c,
+                          Pair<size_t>  xs,
+                          Pair<size_t>  ys,
+                          Pair<size_t>  zs,
+                          MemoryOrder   order) {
+    using LeafT = openvdb::FloatTree::LeafNodeType;
+    using MaskT = LeafT::NodeMaskType;
+
+    constexpr size_t LEAF_DIM = LeafT::DIM;
+
+    auto sub_grids  = make_grids(field_count, c);
+    auto background = build_background(c);
+
+    std::array<Pair<size_t>, 3> const ranges = { xs, ys, zs };
+
+    auto const axes = traversal_axes(order);
+
+    auto const& r0 = ranges[axes[0]];
+    auto const& r1 = ranges[axes[1]];
+    auto const& r2 = ranges[axes[2]];
+
+    auto block_start = [](size_t v) { return v & ~(LEAF_DIM - 1); };
+
+    // leaves that ended up empty are kept around for the next block. Nothing
+    // has been written to them, so their buffers are still all background.
+    std::vector<std::unique_ptr<LeafT>> leaves(field_count);
+    std::vector<float*>                 buffers(field_count);
+
+    std::vector<float> scratch;
+    std::vector<float> low(field_count);
+    std::vector<float> high(field_count);
+
+    std::array<size_t, 3> b;
+
+    auto& bi = b[axes[0]];
+    auto& bj = b[axes[1]];
+    auto& bk = b[axes[2]];
+
+    for (bi = block_start(r0.first); bi < r0.second; bi += LEAF_DIM) {
+        for (bj = block_start(r1.first); bj < r1.second; bj += LEAF_DIM) {
+            for (bk = block_start(r2.first); bk < r2.second; bk += LEAF_DIM) {
+                // this block clipped to the chunk
+                std::array<Pair<size_t>, 3> clip;
+
+                for (size_t axis = 0; axis < 3; axis++) {
+                    clip[axis] = {
+                        std::max(b[axis], ranges[axis].first),
+                        std::min(b[axis] + LEAF_DIM, ranges[axis].second),
+                    };
+                }
+
+                openvdb::Coord origin(b[0], b[1], b[2]);
+
+                for (size_t f = 0; f < field_count; f++) {
+                    if (!leaves[f]) {
+                        leaves[f] = std::make_unique<LeafT>(origin, background);
+                    } else {
+                        leaves[f]->setOrigin(origin);
                     }
-                } else if constexpr (std::is_same_v<RetType, float>) {
 
-                    auto value = a(x, y, z);
+                    buffers[f] = leaves[f]->buffer().data();
+                    low[f]     = std::numeric_limits<float>::max();
+                    high[f]    = std::numeric_limits<float>::lowest();
+                }
 
-                    accessor.setValue(ijk, value);
+                MaskT mask;
 
-                } else {
-                    static_assert(dependent_false<RetType>::value,
-                                  "Unknown Reader return type");
+                std::array<size_t, 3> p;
+
+                auto& i = p[axes[0]];
+                auto& j = p[axes[1]];
+
+                auto const& c0 = clip[axes[0]];
+                auto const& c1 = clip[axes[1]];
+                auto const& c2 = clip[axes[2]];
+
+                auto store = [&](float const* v) {
+                    auto offset = LeafT::coordToOffset(
+                        openvdb::Coord(p[0], p[1], p[2]));
+
+                    mask.setOn(offset);
+
+                    for (size_t f = 0; f < field_count; f++) {
+                        buffers[f][offset] = v[f];
+                        low[f]             = std::min(low[f], v[f]);
+                        high[f]            = std::max(high[f], v[f]);
+                    }
+                };
+
+                for (i = c0.first; i < c0.second; ++i) {
+                    for (j = c1.first; j < c1.second; ++j) {
+                        for_each_in_row(a,
+                                        p,
+                                        axes[2],
+                                        c2,
+                                        field_count,
+                                        c,
+                                        scratch,
+                                        store);
+                    }
+                }
+
+                if (mask.isOff()) continue;
+
+                bool uniform = c.sparse_background && mask.isOn();
+
+                for (size_t f = 0; uniform && f < field_count; f++) {
+                    uniform = high[f] - low[f] <= c.sparse_tolerance;
+                }
+
+                for (size_t f = 0; f < field_count; f++) {
+                    auto& tree = sub_grids[f]->tree();
+
+                    if (uniform) {
+                        // the buffer was overwritten everywhere; reset it so
+                        // the leaf can be reused
+                        leaves[f]->buffer().fill(background);
+                        tree.addTile(
+                            1, origin, low[f] + (high[f] - low[f]) / 2, true);
+                    } else {
+                        leaves[f]->setValueMask(mask);
+                        tree.addLeaf(leaves[f].release());
+                    }
                 }
             }
         }
+    }
+
+    return sub_grids;
+}
+
+template <class Reader>
+FloatGrids vdb_chunk_with(Reader const& a,
+                          size_t        field_count,
+                          Config const& c,
+                          Pair<size_t>  xs,
+                          Pair<size_t>  ys,
+                          Pair<size_t>  zs,
+                          MemoryOrder   order) {
+    switch (c.engine) {
+    case BuildEngine::LEAF:
+        return vdb_chunk_leaf(a, field_count, c, xs, ys, zs, order);
+    case BuildEngine::ACCESSOR: break;
+    }
+    return vdb_chunk(a, field_count, c, xs, ys, zs, order);
+}
+
+// Internal node types of a FloatTree. Level 1 nodes (128^3) are the unit of
+// work for a build; level 2 nodes (4096^3) are what the root holds.
+using FloatNode2 = openvdb::FloatTree::RootNodeType::ChildNodeType;
+using FloatNode1 = FloatNode2::ChildNodeType;
+
+// Tiling of a box of voxels [lo, hi) into tiles aligned to level 1 internal
+// nodes. Tile and group coordinates are global (tile 0 starts at voxel 0);
+// local tile numbers run over the box with X fastest.
+struct TileLayout {
+    static constexpr size_t TILE_DIM  = FloatNode1::DIM;
+    static constexpr size_t GROUP_DIM = FloatNode2::DIM / FloatNode1::DIM;
 
-        if (!c.use_threads && c.has_flag("--progress")) {
-            std::cout << "P: " << z << "/" << zs.second - 1 << std::endl;
+    std::array<size_t, 3> lo, hi;
+    std::array<size_t, 3> first_tile, tile_counts;
+    std::array<size_t, 3> first_group, group_counts;
+
+    TileLayout(std::array<size_t, 3> l, std::array<size_t, 3> h)
+        : lo(l), hi(h) {
+        for (size_t i = 0; i < 3; i++) {
+            first_tile[i] = lo[i] / TILE_DIM;
+            tile_counts[i] =
+                (hi[i] + TILE_DIM - 1) / TILE_DIM - first_tile[i];
+
+            first_group[i] = first_tile[i] / GROUP_DIM;
+            group_counts[i] =
+                (first_tile[i] + tile_counts[i] + GROUP_DIM - 1) / GROUP_DIM -
+                first_group[i];
+        }
+    }
+
+    explicit TileLayout(std::array<size_t, 3> dims)
+        : TileLayout({ 0, 0, 0 }, dims) { }
+
+    size_t tile_count() const {
+        return tile_counts[0] * tile_counts[1] * tile_counts[2];
+    }
+
+    size_t group_count() const {
+        return group_counts[0] * group_counts[1] * group_counts[2];
+    }
+
+    // range of global tile coordinates along an axis
+    Pair<size_t> tile_span(size_t axis) const {
+        return { first_tile[axis], first_tile[axis] + tile_counts[axis] };
+    }
+
+    size_t tile_index(size_t tx, size_t ty, size_t tz) const {
+        return (tx - first_tile[0]) +
+               tile_counts[0] * ((ty - first_tile[1]) +
+                                 tile_counts[1] * (tz - first_tile[2]));
+    }
+
+    std::array<size_t, 3> tile_coord(size_t t) const {
+        return { first_tile[0] + t % tile_counts[0],
+                 first_tile[1] + (t / tile_counts[0]) % tile_counts[1],
+                 first_tile[2] + t / (tile_counts[0] * tile_counts[1]) };
+    }
+
+    std::array<size_t, 3> group_coord(size_t g) const {
+        return { first_group[0] + g % group_counts[0],
+                 first_group[1] + (g / group_counts[0]) % group_counts[1],
+                 first_group[2] + g / (group_counts[0] * group_counts[1]) };
+    }
+
+    // voxel range of a tile along an axis, clipped to the box
+    Pair<size_t> tile_range(size_t t, size_t axis) const {
+        size_t first = t * TILE_DIM;
+        return { std::max(first, lo[axis]),
+                 std::min(first + TILE_DIM, hi[axis]) };
+    }
+
+    // voxels of the box inside tile t
+    uint64_t tile_voxels(size_t t) const {
+        auto     tc  = tile_coord(t);
+        uint64_t ret = 1;
+
+        for (size_t axis = 0; axis < 3; axis++) {
+            auto range = tile_range(tc[axis], axis);
+            ret *= range.second - range.first;
+        }
+
+        return ret;
+    }
+};
+
+// Edge of the blocks a tile is built in. Whole tiles are used unless there
+// are too few of them to keep the workers busy; tiles are then split into
+// leaf aligned blocks, down to 32^3.
+inline size_t tile_block_dim(TileLayout const& layout, Config const& c) {
+    size_t const workers = thread_count(c);
+    size_t       block   = TileLayout::TILE_DIM;
+
+    while (block > 32) {
+        size_t per_tile = TileLayout::TILE_DIM / block;
+        size_t tasks    = layout.tile_count() * per_tile * per_tile * per_tile;
+
+        if (tasks >= workers) break;
+
+        block /= 2;
+    }
+
+    return block;
+}
+
+// Build a chunk in blocks of at most block voxels along each axis, in
+// parallel, and merge them into the grids of the first. Blocks are leaf
+// aligned, so the merge only moves nodes.
+template <class Reader>
+FloatGrids vdb_chunk_blocks(Reader const& a,
+                            size_t        field_count,
+                            Config const& c,
+                            Pair<size_t>  xs,
+                            Pair<size_t>  ys,
+                            Pair<size_t>  zs,
+                            MemoryOrder   order,
+                            size_t        block) {
+    if (block >= TileLayout::TILE_DIM) {
+        return vdb_chunk_with(a, field_count, c, xs, ys, zs, order);
+    }
+
+    auto split = [block](Pair<size_t> r) {
+        std::vector<Pair<size_t>> ret;
+
+        for (size_t b = r.first; b < r.second;) {
+            size_t end = std::min((b / block + 1) * block, r.second);
+            ret.push_back({ b, end });
+            b = end;
+        }
+
+        return ret;
+    };
+
+    auto bx = split(xs);
+    auto by = split(ys);
+    auto bz = split(zs);
+
+    std::vector<FloatGrids> parts(bx.size() * by.size() * bz.size());
+
+    tbb::parallel_for(
+        tbb::blocked_range<size_t>(0, parts.size()), [&](auto const& range) {
+            for (auto i = range.begin(); i != range.end(); ++i) {
+                size_t ix = i % bx.size();
+                size_t iy = (i / bx.size()) % by.size();
+                size_t iz = i / (bx.size() * by.size());
+
+                parts[i] = vdb_chunk_with(
+                    a, field_count, c, bx[ix], by[iy], bz[iz], order);
+            }
+        });
+
+    for (size_t i = 1; i < parts.size(); i++) {
+        for (size_t f = 0; f < field_count; f++) {
+            parts[0][f]->tree().merge(parts[i][f]->tree());
         }
     }
-    return sub_grid;
+
+    return std::move(parts.front());
 }
 
+// Result of building one tile: either a level 1 node, a constant active
+// value covering the whole tile, or nothing at all.
+struct TileResult {
+    std::unique_ptr<FloatNode1> node;
+    std::optional<float>        value;
+};
+
+// Build one tile and take the level 1 node of each field out of the scratch
+// trees. In a sparse build the scratch trees are pruned first, which is cheap
+// at this size and may turn a whole tile into a constant.
 template <class Reader>
-[[nodiscard]] auto
-build_open_vdb(std::array<size_t, 3> dims, Reader const& a, Config const& c) {
-    std::cout << "Starting VDB build..." << std::endl;
-    std::list<openvdb::FloatGrid::Ptr> sub_grids;
+std::vector<TileResult> build_tile(TileLayout const& layout,
+                                   size_t            t,
+                                   Reader const&     a,
+                                   size_t            field_count,
+                                   Config const&     c,
+                                   MemoryOrder       order,
+                                   size_t            block) {
+    auto tc = layout.tile_coord(t);
+
+    auto xs = layout.tile_range(tc[0], 0);
+    auto ys = layout.tile_range(tc[1], 1);
+    auto zs = layout.tile_range(tc[2], 2);
+
+    PhaseTimer timer(c, "build_tile", PhaseTimer::Clock::THREAD);
+    timer.add_voxels(layout.tile_voxels(t));
+
+    auto sub_grids =
+        vdb_chunk_blocks(a, field_count, c, xs, ys, zs, order, block);
+
+    openvdb::Coord origin(xs.first, ys.first, zs.first);
+
+    std::vector<TileResult> ret(field_count);
+
+    for (size_t f = 0; f < field_count; f++) {
+        auto& tree = sub_grids[f]->tree();
+
+        if (c.sparse_background) {
+            openvdb::tools::prune(tree, c.sparse_tolerance);
+        }
+
+        ret[f].node.reset(tree.root().template stealNode<FloatNode1>(
+            origin, tree.background(), false));
+
+        if (!ret[f].node) {
+            float value;
+            if (tree.probeValue(origin, value)) ret[f].value = value;
+        }
+    }
+
+    return ret;
+}
+
+// Graft tile nodes into a tree. Tiles are disjoint, so each level 2 node can
+// be assembled independently; only attaching those to the root is serial,
+// and there are very few of them.
+inline openvdb::FloatGrid::Ptr graft_tiles(TileLayout const&        layout,
+                                           std::vector<TileResult>& tiles,
+                                           Config const&            c) {
+    auto main_grid  = openvdb::FloatGrid::create(build_background(c));
+    auto background = main_grid->background();
+
+    std::vector<std::unique_ptr<FloatNode2>> groups(layout.group_count());
+
+    auto graft_group = [&](size_t g) {
+        auto gc = layout.group_coord(g);
+
+        std::unique_ptr<FloatNode2> group;
+
+        auto const D = TileLayout::GROUP_DIM;
+
+        // tiles of this group that fall inside the box
+        auto span = [&](size_t axis) {
+            auto inside = layout.tile_span(axis);
+            return make_pair(std::max(gc[axis] * D, inside.first),
+                             std::min((gc[axis] + 1) * D, inside.second));
+        };
+
+        auto xs = span(0);
+        auto ys = span(1);
+        auto zs = span(2);
+
+        for (size_t tz = zs.first; tz < zs.second; tz++) {
+            for (size_t ty = ys.first; ty < ys.second; ty++) {
+                for (size_t tx = xs.first; tx < xs.second; tx++) {
+                    auto& tile = tiles[layout.tile_index(tx, ty, tz)];
+
+                    if (!tile.node && !tile.value) continue;
+
+                    openvdb::Coord origin(tx * TileLayout::TILE_DIM,
+                                          ty * TileLayout::TILE_DIM,
+                                          tz * TileLayout::TILE_DIM);
+
+                    if (!group) {
+                        group = std::make_unique<FloatNode2>(
+                            origin, background, false);
+                    }
+
+                    if (tile.node) {
+                        if (group->addChild(tile.node.get())) {
+                            tile.node.release();
+                        }
+                    } else {
+                        group->addTile(FloatNode2::LEVEL,
+                                       origin,
+                                       tile.value.value(),
+                                       true);
+                    }
+                }
+            }
+        }
+
+        groups[g] = std::move(group);
+    };
+
+    if (c.use_threads) {
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, groups.size()),
+                          [&](auto const& range) {
+                              for (auto g = range.begin(); g != range.end();
+                                   ++g) {
+                                  graft_group(g);
+                              }
+                          });
+    } else {
+        for (size_t g = 0; g < groups.size(); g++) {
+            graft_group(g);
+        }
+    }
+
+    auto& root = main_grid->tree().root();
+
+    for (auto& group : groups) {
+        if (group && root.addChild(group.get())) group.release();
+    }
+
+    return main_grid;
+}
+
+// Copy of a config for the builds of one conversion. With --progress, they
+// all report to one reporter covering total voxels, which prints its last
+// line when the final copy goes away. A config that already has a reporter
+// is kept as is.
+inline Config with_progress(Config const& c, uint64_t total) {
+    Config ret = c;
+
+    if (!ret.progress && c.has_flag("--progress")) {
+        ret.progress = std::make_shared<ProgressReporter>(total);
+    }
+
+    return ret;
+}
+
+// Build the voxels in the box [lo, hi) from a multi-field reader, giving one
+// grid per field. The reader is called with global coordinates, and voxels
+// are visited in the given source memory order. No pruning is done, so the
+// result can be merged with grids from neighbouring boxes first.
+template <class Reader>
+[[nodiscard]] FloatGrids
+build_open_vdb_fields_region(std::array<size_t, 3> lo,
+                             std::array<size_t, 3> hi,
+                             size_t                field_count,
+                             Reader const&         a,
+                             Config const&         c,
+                             MemoryOrder           order = MemoryOrder::F) {
+    TileLayout layout(lo, hi);
+
+    PhaseTimer timer(c, "build");
+    timer.add_voxels((hi[0] - lo[0]) * (hi[1] - lo[1]) * (hi[2] - lo[2]));
 
-    std::mutex grid_mutex;
+    // tiles[field][tile]
+    std::vector<std::vector<TileResult>> tiles(field_count);
 
+    for (auto& field_tiles : tiles) {
+        field_tiles.resize(layout.tile_count());
+    }
+
+    std::shared_ptr<ProgressReporter> progress = c.progress;
+
+    if (!progress && c.has_flag("--progress")) {
+        uint64_t total = 0;
+
+        for (size_t t = 0; t < layout.tile_count(); t++) {
+            total += layout.tile_voxels(t);
+        }
+
+        progress = std::make_shared<ProgressReporter>(total);
+    }
+
+    size_t const block = tile_block_dim(layout, c);
+
+    auto run_tile = [&](size_t t) {
+        auto results = build_tile(layout, t, a, field_count, c, order, block);
+
+        for (size_t f = 0; f < field_count; f++) {
+            tiles[f][t] = std::move(results[f]);
+        }
+
+        if (progress) progress->add(layout.tile_voxels(t));
+    };
 
     if (c.use_threads) {
         tbb::parallel_for(
-            tbb::blocked_range<int>(0, dims[2]),
-            [dims, &a, &c, &grid_mutex, &sub_grids](auto const& range) {
-                auto sub_grid =
-                    vdb_chunk(a,
-                              c,
-                              { 0, dims[0] },
-                              { 0, dims[1] },
-                              make_pair(range.begin(), range.end()));
-
-                {
-                    std::scoped_lock lock(grid_mutex);
-
-                    sub_grids.push_back(sub_grid);
+            tbb::blocked_range<size_t>(0, layout.tile_count(), c.grain_size),
+            [&](auto const& range) {
+                for (auto t = range.begin(); t != range.end(); ++t) {
+                    run_tile(t);
                 }
             });
     } else {
-        auto grid = vdb_chunk(a,
-                              c,
-                              { 0, dims[0] },
-                              { 0, dims[1] },
-                              make_pair(size_t { 0 }, dims[2]));
-        sub_grids.push_back(grid);
+        for (size_t t = 0; t < layout.tile_count(); t++) {
+            run_tile(t);
+        }
     }
 
-    // merge grids
+    progress.reset();
 
     std::cout << "Collecting VDB subgrids..." << std::endl;
 
-    openvdb::FloatGrid::Ptr main_grid;
+    PhaseTimer merge_timer(c, "merge");
 
-    if (sub_grids.size() == 0) { return main_grid; }
+    FloatGrids ret;
+
+    for (auto& field_tiles : tiles) {
+        ret.push_back(graft_tiles(layout, field_tiles, c));
+    }
+
+    merge_timer.add_grids(ret);
+
+    return ret;
+}
+
+// Single field version of build_open_vdb_fields_region
+template <class Reader>
+[[nodiscard]] openvdb::FloatGrid::Ptr
+build_open_vdb_region(std::array<size_t, 3> lo,
+                      std::array<size_t, 3> hi,
+                      Reader const&         a,
+                      Config const&         c,
+                      MemoryOrder           order = MemoryOrder::F) {
+    return build_open_vdb_fields_region(lo, hi, 1, as_fields(a), c, order)
+        .front();
+}
+
+// The voxels of a dense source that a build samples, from the config's region
+// of interest and stride. Along each axis, voxel lo + i * stride of the source
+// becomes voxel out_lo + i of the grids, for i < dims. A cropped grid so keeps
+// the index coordinates it had in the full volume.
+struct SampleBox {
+    std::array<size_t, 3> lo, stride, dims, out_lo;
+
+    bool covers(std::array<size_t, 3> source_dims) const {
+        return lo == std::array<size_t, 3> { 0, 0, 0 } &&
+               stride == std::array<size_t, 3> { 1, 1, 1 } &&
+               dims == source_dims;
+    }
+
+    std::array<size_t, 3> source(size_t x, size_t y, size_t z) const {
+        return { lo[0] + (x - out_lo[0]) * stride[0],
+                 lo[1] + (y - out_lo[1]) * stride[1],
+                 lo[2] + (z - out_lo[2]) * stride[2] };
+    }
+
+    // Grid voxels [lo, hi) sampled from source voxels in [src_lo, src_hi)
+    Pair<std::array<size_t, 3>> region(std::array<size_t, 3> src_lo,
+                                       std::array<size_t, 3> src_hi) const {
+        Pair<std::array<size_t, 3>> ret;
+
+        for (size_t i = 0; i < 3; i++) {
+            auto first = [&](size_t v) {
+                if (v <= lo[i]) return size_t(0);
+                return std::min((v - lo[i] + stride[i] - 1) / stride[i],
+                                dims[i]);
+            };
+
+            size_t begin = first(src_lo[i]);
+            size_t end   = std::max(first(src_hi[i]), begin);
+
+            ret.first[i]  = out_lo[i] + begin;
+            ret.second[i] = out_lo[i] + end;
+        }
+
+        return ret;
+    }
+
+    // Place each sampled voxel of a grid where its source voxel was
+    void place(openvdb::math::Transform& transform) const {
+        transform.preTranslate(openvdb::Vec3d(
+            lo[0] % stride[0], lo[1] % stride[1], lo[2] % stride[2]));
+        transform.preScale(openvdb::Vec3d(stride[0], stride[1], stride[2]));
+    }
+};
+
+// Region of interest is clamped to the source
+inline SampleBox sample_box(std::array<size_t, 3> dims, Config const& c) {
+    SampleBox ret;
+
+    for (size_t i = 0; i < 3; i++) {
+        size_t lo = 0;
+        size_t hi = dims[i];
+
+        if (c.roi) {
+            hi = std::min((*c.roi)[i][1], dims[i]);
+            lo = std::min((*c.roi)[i][0], hi);
+        }
+
+        size_t s = std::max<size_t>(c.sample_stride[i], 1);
+
+        ret.lo[i]     = lo;
+        ret.stride[i] = s;
+        ret.dims[i]   = (hi - lo + s - 1) / s;
+        ret.out_lo[i] = lo / s;
+    }
+
+    return ret;
+}
+
+// Multi-field reader over the sampled voxels of another, called with grid
+// coordinates. Only sampled voxels of the source are ever read, so a mapped
+// file only has the pages of the region faulted in.
+template <class Reader, bool = has_read_row<Reader>::value>
+struct SampledReader {
+    Reader const&    a;
+    SampleBox const& box;
+    size_t           field_count;
+
+    bool operator()(size_t x, size_t y, size_t z, float* out) const {
+        auto p = box.source(x, y, z);
+        return a(p[0], p[1], p[2], out);
+    }
+};
+
+// Rows without a stride along them are forwarded whole; strided rows are
+// read a voxel at a time
+template <class Reader>
+struct SampledReader<Reader, true> : SampledReader<Reader, false> {
+    void read_row(size_t x,
+                  size_t y,
+                  size_t z,
+                  size_t axis,
+                  size_t count,
+                  float* out) const {
+        auto const& box = this->box;
+        auto        p   = box.source(x, y, z);
 
-    if (sub_grids.size() == 1) {
-        main_grid = sub_grids.back();
+        if (box.stride[axis] == 1) {
+            this->a.read_row(p[0], p[1], p[2], axis, count, out);
+            return;
+        }
+
+        thread_local std::vector<float> voxel;
+        voxel.resize(this->field_count);
+
+        for (size_t i = 0; i < count; i++, p[axis] += box.stride[axis]) {
+            this->a.read_row(p[0], p[1], p[2], axis, 1, voxel.data());
+
+            for (size_t f = 0; f < this->field_count; f++) {
+                out[f * count + i] = voxel[f];
+            }
+        }
+    }
+};
+
+template <class Reader>
+SampledReader<Reader> sampled_reader(Reader const&    a,
+                                     SampleBox const& box,
+                                     size_t           field_count) {
+    if constexpr (has_read_row<Reader>::value) {
+        return { { a, box, field_count } };
     } else {
-        main_grid = openvdb::FloatGrid::create();
+        return { a, box, field_count };
+    }
+}
+
+inline void prune_grid(openvdb::FloatGrid& grid, Config const& c) {
+    if (!c.prune_amount) return;
+
+    std::cout << "Pruning..." << std::endl;
+
+    PhaseTimer timer(c, "prune");
+    openvdb::tools::prune(grid.tree(), *c.prune_amount);
+}
+
+template <class Reader>
+[[nodiscard]] FloatGrids
+build_open_vdb_fields(std::array<size_t, 3> dims,
+                      size_t                field_count,
+                      Reader const&         a,
+                      Config const&         c,
+                      MemoryOrder           order = MemoryOrder::F) {
+    std::cout << "Starting VDB build..." << std::endl;
+
+    auto const box = sample_box(dims, c);
+
+    FloatGrids grids;
+
+    if (box.covers(dims)) {
+        grids = build_open_vdb_fields_region(
+            { 0, 0, 0 }, dims, field_count, a, c, order);
+    } else {
+        std::cout << "Sampling " << box.dims[0] << " " << box.dims[1] << " "
+                  << box.dims[2] << " voxels from " << box.lo[0] << " "
+                  << box.lo[1] << " " << box.lo[2] << " with stride "
+                  << box.stride[0] << " " << box.stride[1] << " "
+                  << box.stride[2] << std::endl;
+
+        auto reader = sampled_reader(a, box, field_count);
+
+        std::array<size_t, 3> hi;
 
-        while (!sub_grids.empty()) {
-            auto ptr = sub_grids.back();
-            sub_grids.pop_back();
+        for (size_t i = 0; i < 3; i++) {
+            hi[i] = box.out_lo[i] + box.dims[i];
+        }
+
+        grids = build_open_vdb_fields_region(
+            box.out_lo, hi, field_count, reader, c, order);
 
-            openvdb::tools::compReplace(*main_grid, *ptr);
+        for (auto& grid : grids) {
+            box.place(grid->transform());
         }
     }
 
-    if (c.prune_amount) {
-        std::cout << "Pruning..." << std::endl;
-        openvdb::tools::prune(main_grid->tree(), *c.prune_amount);
+    for (auto& grid : grids) {
+        prune_grid(*grid, c);
     }
 
-    return main_grid;
+    return grids;
 }
 
+template <class Reader>
+[[nodiscard]] auto build_open_vdb(std::array<size_t, 3> dims,
+                                  Reader const&         a,
+                                  Config const&         c,
+                                  MemoryOrder           order = MemoryOrder::F) {
+    return build_open_vdb_fields(dims, 1, as_fields(a), c, order).front();
+}
+
+// Combine three component grids, as built by build_open_vdb_fields, into a
+// vector grid. The components share their active voxels, but pruning may
+// have turned a leaf of one into a tile, so the union of their nodes is used.
+inline openvdb::Vec3SGrid::Ptr make_vec3_grid(FloatGrids const& xyz,
+                                              Config const&     c) {
+    using Vec3STree = openvdb::Vec3STree;
+    using FloatLeaf = openvdb::FloatTree::LeafNodeType;
+
+    std::array<openvdb::FloatTree const*, 3> trees = {
+        &xyz[0]->tree(), &xyz[1]->tree(), &xyz[2]->tree()
+    };
+
+    auto tree = std::make_shared<Vec3STree>(
+        *trees[0], openvdb::Vec3s(0), openvdb::TopologyCopy());
+
+    tree->topologyUnion(*trees[1]);
+    tree->topologyUnion(*trees[2]);
+
+    auto value_at = [&](openvdb::Coord const& ijk) {
+        return openvdb::Vec3s(trees[0]->getValue(ijk),
+                              trees[1]->getValue(ijk),
+                              trees[2]->getValue(ijk));
+    };
+
+    openvdb::tree::LeafManager<Vec3STree> leaves(*tree);
+
+    leaves.foreach(
+        [&](Vec3STree::LeafNodeType& leaf, size_t) {
+            std::array<FloatLeaf const*, 3> sources;
+
+            for (size_t i = 0; i < 3; i++) {
+                sources[i] = trees[i]->probeConstLeaf(leaf.origin());
+            }
+
+            // components without a leaf here have a constant tile
+            auto constant = value_at(leaf.origin());
+
+            for (auto iter = leaf.beginValueOn(); iter; ++iter) {
+                auto value = constant;
+
+                for (size_t i = 0; i < 3; i++) {
+                    if (sources[i]) value[i] = sources[i]->getValue(iter.pos());
+                }
+
+                iter.setValue(value);
+            }
+        },
+        c.use_threads);
+
+    // tiles left are constant in every component
+    auto tiles = tree->beginValueOn();
+    tiles.setMaxDepth(Vec3STree::ValueOnIter::LEAF_DEPTH - 1);
+
+    for (; tiles; ++tiles) {
+        tiles.setValue(value_at(tiles.getCoord()));
+    }
+
+    auto grid = openvdb::Vec3SGrid::create(tree);
+    grid->setTransform(xyz[0]->transform().copy());
+
+    return grid;
+}
+
+// Build a box of AMR cells from a multi-field reader, serially, giving one
+// grid per field. The reader is called with cell coordinates local to the
+// box, and returns false to leave a cell inactive. Each cell covers scale
+// voxels along each axis, starting at lo * scale, so the cells of a coarse
+// level land in the index space of a finer one. Voxels are written leaf by
+// leaf straight into value buffers, reading each cell once per leaf it
+// touches, and a leaf lying inside a single cell becomes a tile. Meant to
+// be run for many boxes in parallel, merging the results.
+template <class Reader>
+FloatGrids build_box_fields(std::array<int, 3>    lo,
+                            std::array<size_t, 3> dims,
+                            std::array<int, 3>    scale,
+                            size_t                field_count,
+                            Reader const&         a,
+                            Config const&         c) {
+    using FloatLeaf = openvdb::FloatTree::LeafNodeType;
+
+    constexpr int LEAF_DIM = FloatLeaf::DIM;
+
+    auto grids = make_grids(field_count, c);
+
+    auto floor_div = [](int v, int d) {
+        return v / d - (v % d != 0 && v < 0);
+    };
+
+    // voxels covered by the box
+    std::array<int, 3> vlo, vhi;
+
+    for (size_t i = 0; i < 3; i++) {
+        vlo[i] = lo[i] * scale[i];
+        vhi[i] = (lo[i] + int(dims[i])) * scale[i];
+    }
+
+    std::vector<float> values(field_count);
+
+    std::vector<std::unique_ptr<FloatLeaf>> leaves(field_count);
+
+    auto read = [&](std::array<int, 3> cell) {
+        return a(size_t(cell[0]), size_t(cell[1]), size_t(cell[2]),
+                 values.data()) &&
+               keep_voxel(values.data(), field_count, c);
+    };
+
+    // set the voxels [w0, w1) of a leaf
+    auto fill = [](FloatLeaf&         leaf,
+                   std::array<int, 3> w0,
+                   std::array<int, 3> w1,
+                   float              value) {
+        openvdb::Coord ijk;
+
+        for (ijk[2] = w0[2]; ijk[2] < w1[2]; ijk[2]++) {
+            for (ijk[1] = w0[1]; ijk[1] < w1[1]; ijk[1]++) {
+                for (ijk[0] = w0[0]; ijk[0] < w1[0]; ijk[0]++) {
+                    leaf.setValueOn(ijk, value);
+                }
+            }
+        }
+    };
+
+    openvdb::Coord o;
+
+    for (o[2] = vlo[2] & ~(LEAF_DIM - 1); o[2] < vhi[2]; o[2] += LEAF_DIM) {
+        for (o[1] = vlo[1] & ~(LEAF_DIM - 1); o[1] < vhi[1];
+             o[1] += LEAF_DIM) {
+            for (o[0] = vlo[0] & ~(LEAF_DIM - 1); o[0] < vhi[0];
+                 o[0] += LEAF_DIM) {
+                // voxels of the box in this leaf, and the local cells
+                // covering them, [c0, c1)
+                std::array<int, 3> v0, v1, c0, c1;
+
+                bool whole = true;
+
+                for (size_t i = 0; i < 3; i++) {
+                    v0[i] = std::max(o[i], vlo[i]);
+                    v1[i] = std::min(o[i] + LEAF_DIM, vhi[i]);
+                    c0[i] = floor_div(v0[i], scale[i]) - lo[i];
+                    c1[i] = floor_div(v1[i] - 1, scale[i]) - lo[i] + 1;
+
+                    whole &= c1[i] - c0[i] == 1 && v0[i] == o[i] &&
+                             v1[i] == o[i] + LEAF_DIM;
+                }
+
+                if (whole) {
+                    if (!read(c0)) continue;
+
+                    for (size_t f = 0; f < field_count; f++) {
+                        grids[f]->tree().addTile(1, o, values[f], true);
+                    }
+
+                    continue;
+                }
+
+                std::array<int, 3> cell;
+
+                for (cell[2] = c0[2]; cell[2] < c1[2]; cell[2]++) {
+                    for (cell[1] = c0[1]; cell[1] < c1[1]; cell[1]++) {
+                        for (cell[0] = c0[0]; cell[0] < c1[0]; cell[0]++) {
+                            if (!read(cell)) continue;
+
+                            // voxels of the cell inside this leaf
+                            std::array<int, 3> w0, w1;
+
+                            for (size_t i = 0; i < 3; i++) {
+                                int first = (lo[i] + cell[i]) * scale[i];
+
+                                w0[i] = std::max(first, v0[i]);
+                                w1[i] = std::min(first + scale[i], v1[i]);
+                            }
+
+                            for (size_t f = 0; f < field_count; f++) {
+                                if (!leaves[f]) {
+                                    leaves[f] = std::make_unique<FloatLeaf>(
+                                        o, grids[f]->background(), false);
+                                }
+
+                                fill(*leaves[f], w0, w1, values[f]);
+                            }
+                        }
+                    }
+                }
+
+                for (size_t f = 0; f < field_count; f++) {
+                    if (leaves[f]) {
+                        grids[f]->tree().addLeaf(leaves[f].release());
+                    }
+                }
+            }
+        }
+    }
+
+    return grids;
+}
+
+// Merged AMR output holds every level at the finest resolution
+inline void print_amr_merge_note() {
+    std::cout << "Merging AMR levels at the finest resolution; coarse cells "
+                 "are stored densely. Use --amr_per_level to keep each level "
+                 "at its own resolution."
+              << std::endl;
+}
+
+// Merge grids of one type into the first, in pairs, with each level of
+// pairs merged in parallel. Where grids overlap, the earlier grid's active
+// values are kept.
+template <class GridT>
+typename GridT::Ptr merge_pairwise(openvdb::GridPtrVec const& parts,
+                                   Config const&              c) {
+    std::vector<typename GridT::Ptr> grids;
+
+    for (auto const& part : parts) {
+        grids.push_back(openvdb::gridPtrCast<GridT>(part));
+    }
+
+    for (size_t stride = 1; stride < grids.size(); stride *= 2) {
+        size_t const pairs = (grids.size() + 2 * stride - 1) / (2 * stride);
+
+        auto merge_pair = [&](size_t p) {
+            size_t const a = p * 2 * stride;
+            size_t const b = a + stride;
+
+            if (b >= grids.size()) return;
+
+            grids[a]->tree().merge(grids[b]->tree(),
+                                   openvdb::MERGE_ACTIVE_STATES);
+            grids[b].reset();
+        };
+
+        if (c.use_threads) {
+            tbb::parallel_for(size_t(0), pairs, merge_pair);
+        } else {
+            for (size_t p = 0; p < pairs; p++) {
+                merge_pair(p);
+            }
+        }
+    }
+
+    return grids.front();
+}
+
+// Half resolution copy of a grid. Each voxel reduces a 2^3 block of the
+// source as the config asks, and is active if any voxel of the block is.
+// Coarse leaves are laid out first, then filled in parallel.
+inline openvdb::FloatGrid::Ptr downsample(openvdb::FloatGrid const& fine,
+                                          Config const&             c) {
+    using FloatTree = openvdb::FloatTree;
+    using Coord     = openvdb::Coord;
+
+    auto const& fine_tree = fine.tree();
+
+    auto coarse     = openvdb::FloatGrid::create(fine.background());
+    auto background = fine.background();
+
+    auto half = [](Coord const& ijk) {
+        return Coord(ijk.x() >> 1, ijk.y() >> 1, ijk.z() >> 1);
+    };
+
+    for (auto leaf = fine_tree.cbeginLeaf(); leaf; ++leaf) {
+        coarse->tree().touchLeaf(half(leaf->origin()));
+    }
+
+    // constant tiles stay tiles where they cover whole coarse nodes
+    auto tiles = fine_tree.cbeginValueOn();
+    tiles.setMaxDepth(FloatTree::ValueOnCIter::LEAF_DEPTH - 1);
+
+    for (; tiles; ++tiles) {
+        openvdb::CoordBBox box;
+        tiles.getBoundingBox(box);
+
+        coarse->tree().fill(
+            openvdb::CoordBBox(half(box.min()), half(box.max())), *tiles, true);
+    }
+
+    openvdb::tree::LeafManager<FloatTree> leaves(coarse->tree());
+
+    leaves.foreach(
+        [&](FloatTree::LeafNodeType& leaf, size_t) {
+            FloatTree::ConstAccessor acc(fine_tree);
+
+            for (openvdb::Index n = 0; n < leaf.SIZE; n++) {
+                auto base = leaf.offsetToGlobalCoord(n);
+                base      = Coord(base.x() * 2, base.y() * 2, base.z() * 2);
+
+                float sum    = 0;
+                float max    = std::numeric_limits<float>::lowest();
+                bool  active = false;
+
+                for (int d = 0; d < 8; d++) {
+                    auto  ijk   = base.offsetBy(d & 1, (d >> 1) & 1, d >> 2);
+                    float value = acc.getValue(ijk);
+                    bool  on    = acc.isValueOn(ijk);
+
+                    sum += on ? value : background;
+                    if (on) max = std::max(max, value);
+                    active |= on;
+                }
+
+                if (!active) {
+                    leaf.setValueOff(n, background);
+                } else if (c.lod_reduce == LodReduce::MAX) {
+                    leaf.setValueOn(n, max);
+                } else {
+                    leaf.setValueOn(n, sum / 8);
+                }
+            }
+        },
+        c.use_threads);
+
+    openvdb::tools::pruneInactive(coarse->tree());
+
+    return coarse;
+}
+
+// Append config.lod_levels coarser copies of each float grid, named
+// <name>_lod<level>. Their transforms are scaled so that each coarse voxel
+// covers the block it was reduced from.
+inline void add_lod_grids(openvdb::GridPtrVec& grids, Config const& c) {
+    if (c.lod_levels <= 0) return;
+
+    std::cout << "Building " << c.lod_levels << " LOD levels..." << std::endl;
+
+    PhaseTimer timer(c, "lod");
+
+    openvdb::GridPtrVec lods;
+
+    for (auto const& grid : grids) {
+        auto level_grid = openvdb::gridPtrCast<openvdb::FloatGrid>(grid);
+
+        if (!level_grid) continue;
+
+        for (int level = 1; level <= c.lod_levels; level++) {
+            level_grid = downsample(*level_grid, c);
+
+            double const factor = double(1 << level);
+
+            // voxel i covers fine voxels factor * i ... factor * (i + 1) - 1
+            auto transform = grid->transform().copy();
+            transform->preTranslate(openvdb::Vec3d((factor - 1) / 2));
+            transform->preScale(factor);
+
+            level_grid->setTransform(transform);
+            level_grid->setName(grid->getName() + "_lod" +
+                                std::to_string(level));
+            level_grid->insertMeta("lod_level", openvdb::Int32Metadata(level));
+
+            lods.push_back(level_grid);
+        }
+    }
+
+    timer.add_grids(lods);
+
+    grids.insert(grids.end(), lods.begin(), lods.end());
+}
 
 #endif // VDB_TOOLS_H
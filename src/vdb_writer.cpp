@@ -0,0 +1,147 @@
+#include "vdb_writer.h"
+
+#include <tbb/parallel_for.h>
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <set>
+#include <sstream>
+
+namespace {
+
+// Archive::write is protected; expose it for in-memory serialization. Each
+// buffer is a complete single-grid archive.
+class BufferArchive : public openvdb::io::Archive {
+public:
+    explicit BufferArchive(uint32_t compression) {
+        setCompression(compression);
+    }
+
+    std::string serialize(openvdb::GridCPtrVec const& grids) const {
+        std::ostringstream os(std::ios_base::out | std::ios_base::binary);
+        write(os, grids, /*seekable=*/true);
+        return os.str();
+    }
+};
+
+template <class T>
+T load(std::string const& buffer, size_t pos) {
+    T ret;
+    std::memcpy(&ret, buffer.data() + pos, sizeof(T));
+    return ret;
+}
+
+template <class T>
+void store(std::string& buffer, size_t pos, T value) {
+    std::memcpy(buffer.data() + pos, &value, sizeof(T));
+}
+
+// Offset of the grid, block and end positions of the grid section that
+// starts at start. They follow the descriptor's name, type and instance
+// parent strings. The grid itself starts right after the three positions,
+// which is checked.
+std::optional<size_t> stream_pos_offset(std::string const& buffer,
+                                        size_t             start) {
+    size_t pos = start;
+
+    for (int i = 0; i < 3; i++) {
+        if (pos + sizeof(uint32_t) > buffer.size()) return std::nullopt;
+
+        pos += sizeof(uint32_t) + load<uint32_t>(buffer, pos);
+    }
+
+    if (pos + 3 * sizeof(int64_t) > buffer.size()) return std::nullopt;
+
+    int64_t const grid_pos = pos + 3 * sizeof(int64_t);
+
+    if (load<int64_t>(buffer, pos) != grid_pos) return std::nullopt;
+
+    return pos;
+}
+
+bool can_split(openvdb::GridPtrVec const& grids) {
+    std::set<std::string>              names;
+    std::set<openvdb::TreeBase const*> trees;
+
+    for (auto const& grid : grids) {
+        if (!grid) return false;
+        if (!names.insert(grid->getName()).second) return false;
+        if (!trees.insert(&grid->baseTree()).second) return false;
+    }
+
+    return grids.size() > 1;
+}
+
+} // namespace
+
+// Serialize every grid on its own, then write one archive made of the first
+// header and each grid section, with stream positions moved to their new
+// offsets.
+bool write_vdb_split(fs::path const&            path,
+                     openvdb::GridPtrVec const& grids,
+                     uint32_t                   compression) {
+    if (!can_split(grids)) return false;
+
+    // header, file metadata and grid count
+    size_t const head = BufferArchive(compression).serialize({}).size();
+
+    std::vector<std::string> buffers(grids.size());
+
+    tbb::parallel_for(size_t(0), grids.size(), [&](size_t i) {
+        buffers[i] = BufferArchive(compression).serialize({ grids[i] });
+    });
+
+    // each section moves from head in its own buffer to offset in the file
+    int64_t offset = head;
+
+    for (auto& buffer : buffers) {
+        auto pos = stream_pos_offset(buffer, head);
+
+        if (!pos) return false;
+
+        int64_t const shift = offset - int64_t(head);
+
+        for (size_t p = 0; p < 3; p++) {
+            size_t at = *pos + p * sizeof(int64_t);
+            store(buffer, at, load<int64_t>(buffer, at) + shift);
+        }
+
+        offset += buffer.size() - head;
+    }
+
+    auto& first = buffers.front();
+
+    if (load<int32_t>(first, head - sizeof(int32_t)) != 1) return false;
+
+    store(first, head - sizeof(int32_t), int32_t(grids.size()));
+
+    std::ofstream ofs(path, std::ios_base::out | std::ios_base::binary);
+
+    ofs.write(first.data(), head);
+
+    for (auto const& buffer : buffers) {
+        ofs.write(buffer.data() + head, buffer.size() - head);
+    }
+
+    if (!ofs) throw std::runtime_error("Unable to write " + path.string());
+
+    return true;
+}
+
+void write_vdb(fs::path const&            path,
+               openvdb::GridPtrVec const& grids,
+               uint32_t                   compression,
+               bool                       parallel) {
+    if (parallel && can_split(grids)) {
+        if (write_vdb_split(path, grids, compression)) return;
+
+        std::cerr << "Unexpected grid layout, writing serially.\n";
+    }
+
+    openvdb::io::File file(path.string());
+    file.setCompression(compression);
+    file.write(grids);
+    file.close();
+}
@@ -0,0 +1,23 @@
+#ifndef VDB_WRITER_H
+#define VDB_WRITER_H
+
+#include "common.h"
+
+#include <openvdb/openvdb.h>
+
+// Write grids to a .vdb file. With parallel set, each grid is serialized and
+// compressed into memory on its own task, and the pieces are then assembled
+// into one file. Grid sets that need the archive's cross-grid handling
+// (shared trees, repeated names) are written by io::File as before.
+void write_vdb(fs::path const&            path,
+               openvdb::GridPtrVec const& grids,
+               uint32_t                   compression,
+               bool                       parallel);
+
+// The parallel path of write_vdb on its own. False, with nothing written, if
+// the grids need io::File or a serialized grid has an unexpected layout.
+bool write_vdb_split(fs::path const&            path,
+                     openvdb::GridPtrVec const& grids,
+                     uint32_t                   compression);
+
+#endif // VDB_WRITER_H
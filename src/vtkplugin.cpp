@@ -1,12 +1,16 @@
 #include "vtkplugin.h"
 
+#include "threading.h"
 #include "vdb_tools.h"
 
+#include <vtkAMRBox.h>
 #include <vtkAMRInformation.h>
 #include <vtkAMReXGridReader.h>
+#include <vtkCellData.h>
 #include <vtkCompositeDataIterator.h>
 #include <vtkCompositeDataSet.h>
 #include <vtkDataArray.h>
+#include <vtkDataSet.h>
 #include <vtkImageData.h>
 #include <vtkMultiBlockDataSet.h>
 #include <vtkMultiProcessController.h>
@@ -15,7 +19,7 @@
 #include <vtkResampleToImage.h>
 #include <vtkSMPTools.h>
 #include <vtkSmartPointer.h>
-#include <vtkUnstructuredGrid.h>
+#include <vtkUniformGrid.h>
 #include <vtkXMLImageDataReader.h>
 #include <vtkXMLMultiBlockDataReader.h>
 
@@ -23,7 +27,9 @@
 #include <openvdb/openvdb.h>
 #include <openvdb/tools/Composite.h>
 
+#include <algorithm>
 #include <array>
+#include <cmath>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
@@ -40,6 +46,10 @@ enum class VTKTYPE {
     CHAR,
     S_CHAR,
     U_CHAR,
+    SHORT,
+    U_SHORT,
+    INT,
+    U_INT,
     FLOAT,
     DOUBLE,
 };
@@ -50,6 +60,10 @@ VTKTYPE figure_type(int t) {
     case VTK_CHAR: return VTKTYPE::CHAR;
     case VTK_SIGNED_CHAR: return VTKTYPE::S_CHAR;
     case VTK_UNSIGNED_CHAR: return VTKTYPE::U_CHAR;
+    case VTK_SHORT: return VTKTYPE::SHORT;
+    case VTK_UNSIGNED_SHORT: return VTKTYPE::U_SHORT;
+    case VTK_INT: return VTKTYPE::INT;
+    case VTK_UNSIGNED_INT: return VTKTYPE::U_INT;
     case VTK_FLOAT: return VTKTYPE::FLOAT;
     case VTK_DOUBLE: return VTKTYPE::DOUBLE;
     }
@@ -57,55 +71,321 @@ VTKTYPE figure_type(int t) {
     return VTKTYPE::UNKNOWN;
 }
 
-auto write_to_grid(vtkDataArray*                array,
-                   std::string const&           override_name,
-                   std::array<size_t, 3> const& dims,
-                   Config const&                c) {
+// Call f with a value of the C++ type behind an array type, giving nullopt
+// for UNKNOWN
+template <class Function>
+auto dispatch_type(VTKTYPE type, Function&& f)
+    -> std::optional<decltype(f(float()))> {
+    switch (type) {
+    case VTKTYPE::CHAR: return f(char());
+    case VTKTYPE::S_CHAR: return f((signed char)(0));
+    case VTKTYPE::U_CHAR: return f((unsigned char)(0));
+    case VTKTYPE::SHORT: return f(short());
+    case VTKTYPE::U_SHORT: return f((unsigned short)(0));
+    case VTKTYPE::INT: return f(int());
+    case VTKTYPE::U_INT: return f(unsigned());
+    case VTKTYPE::FLOAT: return f(float());
+    case VTKTYPE::DOUBLE: return f(double());
+    case VTKTYPE::UNKNOWN: break;
+    }
 
-    std::cout << "Working on: " << array->GetName() << "\n";
+    return std::nullopt;
+}
 
-    int num_comp = array->GetNumberOfComponents();
+// Array value ranges by name
+using RangeMap = std::unordered_map<std::string, std::array<double, 2>>;
+
+// Points of an image, placed at offset in the output index space. An image
+// resampled from a block of a larger dataset may carry a mask of the points
+// that fell inside the block (non-zero), leaving the others inactive, and
+// ranges of its arrays over the whole dataset, used instead of its own.
+struct ImageBox {
+    std::array<size_t, 3> dims   = { 0, 0, 0 };
+    std::array<size_t, 3> offset = { 0, 0, 0 };
+    char const*           valid  = nullptr;
+    RangeMap const*       ranges = nullptr;
+};
 
-    std::cout << "Number of components " << num_comp << std::endl;
+// Output index space bounds of an image, and the region of it that the
+// config's region of interest and stride sample
+std::array<size_t, 3> image_hi(ImageBox const& box) {
+    return { box.offset[0] + box.dims[0],
+             box.offset[1] + box.dims[1],
+             box.offset[2] + box.dims[2] };
+}
 
-    auto type = figure_type(array->GetDataType());
+Pair<std::array<size_t, 3>> image_region(ImageBox const& box,
+                                         Config const&   c) {
+    auto const hi = image_hi(box);
+    return sample_box(hi, c).region(box.offset, hi);
+}
 
-    std::cout << "Type: " << static_cast<int>(type) << std::endl;
+uint64_t sampled_points(ImageBox const& box, Config const& c) {
+    auto const region = image_region(box, c);
 
-    auto range_min = array->GetRange()[0];
-    auto range_max = array->GetRange()[1];
+    return uint64_t(region.second[0] - region.first[0]) *
+           (region.second[1] - region.first[1]) *
+           (region.second[2] - region.first[2]);
+}
 
-    std::cout << "Range: " << range_min << " " << range_max << std::endl;
+// Range of an array, or of its magnitude with component -1
+std::array<double, 2>
+array_range(vtkDataArray* array, int component, ImageBox const& box) {
+    if (box.ranges) {
+        auto iter = box.ranges->find(array->GetName());
+        if (iter != box.ranges->end()) return iter->second;
+    }
 
-    auto main_grid = build_open_vdb(
-        dims,
-        [&dims, &array, range_min](
-            size_t x, size_t y, size_t z) -> std::optional<float> {
-            int idx = x + y * dims[0] + z * dims[0] * dims[1];
+    auto* range = array->GetRange(component);
+
+    return { range[0], range[1] };
+}
+
+// Build the fields of an image at its place in the output, keeping the
+// points that the config's region of interest and stride sample from the
+// output index space. Readers are called with coordinates local to the
+// image.
+template <class Reader>
+FloatGrids build_image_fields(ImageBox const& box,
+                              size_t          field_count,
+                              Reader const&   a,
+                              Config const&   c) {
+    auto const& o  = box.offset;
+    auto const  hi = image_hi(box);
+
+    auto const sample = sample_box(hi, c);
+    auto const region = sample.region(o, hi);
+
+    auto local = [&a, &box, &sample, o](
+                     size_t x, size_t y, size_t z, float* out) {
+        auto p = sample.source(x, y, z);
+
+        x = p[0] - o[0];
+        y = p[1] - o[1];
+        z = p[2] - o[2];
+
+        if (box.valid) {
+            size_t point = x + box.dims[0] * (y + box.dims[1] * z);
+            if (!box.valid[point]) return false;
+        }
+
+        return a(x, y, z, out);
+    };
+
+    std::cout << "Starting VDB build..." << std::endl;
+
+    auto grids = build_open_vdb_fields_region(
+        region.first, region.second, field_count, local, c);
+
+    for (auto& grid : grids) {
+        if (!sample.covers(hi)) sample.place(grid->transform());
+        prune_grid(*grid, c);
+    }
+
+    return grids;
+}
+
+template <class Reader>
+openvdb::FloatGrid::Ptr
+build_image(ImageBox const& box, Reader const& a, Config const& c) {
+    return build_image_fields(box, 1, as_fields(a), c).front();
+}
+
+// Build from the first component of a raw array of T, with num_comp
+// components per tuple. Image points are stored X fastest.
+template <class T>
+openvdb::FloatGrid::Ptr build_typed(T const*        data,
+                                    size_t          num_comp,
+                                    double          range_min,
+                                    ImageBox const& box,
+                                    Config const&   c) {
+    auto const& dims = box.dims;
+
+    return build_image(
+        box,
+        [=, &dims](size_t x, size_t y, size_t z) -> std::optional<float> {
+            size_t idx = (x + dims[0] * (y + dims[1] * z)) * num_comp;
+
+            double value = data[idx];
+
+            if (value > range_min) return value;
+
+            return std::nullopt;
+        },
+        c);
+}
 
-            double cache[4];
+// Dispatch once on the array type, so the per voxel read is a plain typed
+// load. Other types, and arrays not stored as packed tuples, go through
+// GetComponent.
+openvdb::FloatGrid::Ptr build_from_array(vtkDataArray*   array,
+                                         VTKTYPE         type,
+                                         double          range_min,
+                                         ImageBox const& box,
+                                         Config const&   c) {
+    auto const& dims = box.dims;
+
+    size_t num_comp = array->GetNumberOfComponents();
+
+    void* raw = array->HasStandardMemoryLayout() ? array->GetVoidPointer(0)
+                                                 : nullptr;
+
+    auto typed = [&](auto tag) {
+        using T = decltype(tag);
+        return build_typed(
+            static_cast<T const*>(raw), num_comp, range_min, box, c);
+    };
+
+    if (raw) {
+        if (auto grid = dispatch_type(type, typed)) return *grid;
+    }
 
-            array->GetTuple(idx, cache);
+    std::cout << "Using generic array access." << std::endl;
 
-            double value = cache[0];
+    return build_image(
+        box,
+        [&dims, &array, range_min](
+            size_t x, size_t y, size_t z) -> std::optional<float> {
+            vtkIdType idx = x + dims[0] * (y + dims[1] * z);
+
+            double value = array->GetComponent(idx, 0);
 
             if (value > range_min) return value;
 
             return std::nullopt;
         },
         c);
+}
+
+// A point data array to convert. Points at or below range_min are left
+// inactive.
+struct ArrayField {
+    vtkDataArray* array;
+    VTKTYPE       type;
+    double        range_min;
+};
+
+ArrayField describe_array(vtkDataArray* array, ImageBox const& box) {
+    std::cout << "Working on: " << array->GetName() << "\n";
+
+    int num_comp = array->GetNumberOfComponents();
+
+    std::cout << "Number of components " << num_comp << std::endl;
+
+    auto type = figure_type(array->GetDataType());
 
+    std::cout << "Type: " << static_cast<int>(type) << std::endl;
+
+    auto range     = array_range(array, 0, box);
+    auto range_min = range[0];
+    auto range_max = range[1];
 
+    std::cout << "Range: " << range_min << " " << range_max << std::endl;
+
+    return { array, type, range_min };
+}
+
+void name_grid(openvdb::GridBase& grid,
+               vtkDataArray*      array,
+               std::string const& override_name) {
     if (override_name.size()) {
-        main_grid->setName(override_name);
+        grid.setName(override_name);
 
-        main_grid->insertMeta("source_name",
-                              openvdb::StringMetadata(override_name));
+        grid.insertMeta("source_name", openvdb::StringMetadata(override_name));
 
     } else {
-        main_grid->setName(array->GetName());
+        grid.setName(array->GetName());
+    }
+}
+
+// Reader over several arrays of the same type T with packed tuples. A point
+// is active if any field is above its range minimum.
+template <class T>
+auto fused_reader(std::vector<ArrayField> const& fields,
+                  std::array<size_t, 3> const&   dims) {
+    std::vector<T const*> bases;
+    std::vector<size_t>   comps;
+    std::vector<double>   mins;
+
+    for (auto const& field : fields) {
+        bases.push_back(static_cast<T const*>(field.array->GetVoidPointer(0)));
+        comps.push_back(field.array->GetNumberOfComponents());
+        mins.push_back(field.range_min);
+    }
+
+    return [=, &dims](size_t x, size_t y, size_t z, float* out) -> bool {
+        size_t point = x + dims[0] * (y + dims[1] * z);
+        bool   any   = false;
+
+        for (size_t f = 0; f < bases.size(); f++) {
+            double value = bases[f][point * comps[f]];
+
+            out[f] = value;
+            any |= value > mins[f];
+        }
+
+        return any;
+    };
+}
+
+// Build every field in one traversal, with one shared active topology. When
+// the arrays differ in type or layout each value is read through
+// GetComponent.
+FloatGrids build_fused(std::vector<ArrayField> const& fields,
+                       ImageBox const&                box,
+                       Config const&                  c) {
+    auto const& dims = box.dims;
+
+    bool same_type = true;
+
+    for (auto const& field : fields) {
+        same_type &= field.type == fields.front().type &&
+                     field.type != VTKTYPE::UNKNOWN &&
+                     field.array->HasStandardMemoryLayout();
+    }
+
+    auto build = [&](auto const& reader) {
+        return build_image_fields(box, fields.size(), reader, c);
+    };
+
+    auto typed = [&](auto tag) {
+        return build(fused_reader<decltype(tag)>(fields, dims));
+    };
+
+    if (same_type) {
+        if (auto grids = dispatch_type(fields.front().type, typed)) {
+            return *grids;
+        }
     }
 
+    std::cout << "Using generic array access." << std::endl;
+
+    return build([&](size_t x, size_t y, size_t z, float* out) -> bool {
+        vtkIdType point = x + dims[0] * (y + dims[1] * z);
+        bool      any   = false;
+
+        for (size_t f = 0; f < fields.size(); f++) {
+            double value = fields[f].array->GetComponent(point, 0);
+
+            out[f] = value;
+            any |= value > fields[f].range_min;
+        }
+
+        return any;
+    });
+}
+
+auto write_to_grid(vtkDataArray*      array,
+                   std::string const& override_name,
+                   ImageBox const&    box,
+                   Config const&      c) {
+    auto field = describe_array(array, box);
+
+    auto main_grid =
+        build_from_array(array, field.type, field.range_min, box, c);
+
+    name_grid(*main_grid, array, override_name);
+
 
     /*
 
@@ -166,7 +446,159 @@ auto write_to_grid(vtkDataArray*                array,
     return main_grid;
 }
 
-openvdb::GridPtrVec convert_image(vtkImageData* image, Config const& config) {
+// Reader for the first three components of a raw array of T, optionally
+// followed by the magnitude. A point is active if its magnitude is above
+// range_min.
+template <class T>
+auto vector_reader(T const*                     data,
+                   size_t                       num_comp,
+                   double                       range_min,
+                   bool                         with_magnitude,
+                   std::array<size_t, 3> const& dims) {
+    return [=, &dims](size_t x, size_t y, size_t z, float* out) -> bool {
+        size_t idx = (x + dims[0] * (y + dims[1] * z)) * num_comp;
+
+        double length2 = 0;
+
+        for (size_t i = 0; i < 3; i++) {
+            double value = data[idx + i];
+
+            out[i] = value;
+            length2 += value * value;
+        }
+
+        double length = std::sqrt(length2);
+
+        if (with_magnitude) out[3] = length;
+
+        return length > range_min;
+    };
+}
+
+// Convert a three component array to a Vec3SGrid in one traversal, and with
+// --vector_magnitude also to a magnitude grid
+openvdb::GridPtrVec
+write_to_vector_grid(vtkDataArray*      array,
+                     std::string const& override_name,
+                     ImageBox const&    box,
+                     Config const&      c) {
+    auto const& dims = box.dims;
+
+    std::cout << "Working on vector: " << array->GetName() << "\n";
+
+    auto type = figure_type(array->GetDataType());
+
+    // range of the magnitude
+    auto range     = array_range(array, -1, box);
+    auto range_min = range[0];
+    auto range_max = range[1];
+
+    std::cout << "Magnitude range: " << range_min << " " << range_max
+              << std::endl;
+
+    bool   with_magnitude = c.has_flag("--vector_magnitude");
+    size_t num_comp       = array->GetNumberOfComponents();
+
+    auto build = [&](auto const& reader) {
+        return build_image_fields(box, with_magnitude ? 4 : 3, reader, c);
+    };
+
+    void* raw = array->HasStandardMemoryLayout() ? array->GetVoidPointer(0)
+                                                 : nullptr;
+
+    auto typed = [&](auto tag) {
+        using T = decltype(tag);
+        return build(vector_reader(static_cast<T const*>(raw),
+                                   num_comp,
+                                   range_min,
+                                   with_magnitude,
+                                   dims));
+    };
+
+    std::optional<FloatGrids> grids;
+
+    if (raw) grids = dispatch_type(type, typed);
+
+    if (!grids) {
+        std::cout << "Using generic array access." << std::endl;
+
+        grids = build([&](size_t x, size_t y, size_t z, float* out) -> bool {
+            vtkIdType point = x + dims[0] * (y + dims[1] * z);
+
+            double length2 = 0;
+
+            for (int i = 0; i < 3; i++) {
+                double value = array->GetComponent(point, i);
+
+                out[i] = value;
+                length2 += value * value;
+            }
+
+            double length = std::sqrt(length2);
+
+            if (with_magnitude) out[3] = length;
+
+            return length > range_min;
+        });
+    }
+
+    openvdb::GridPtrVec ret;
+
+    auto vector_grid = make_vec3_grid(*grids, c);
+
+    name_grid(*vector_grid, array, override_name);
+
+    // point vectors, such as velocities, are world space directions sampled
+    // at voxel centers; they rotate and scale with the transform but do not
+    // translate with it
+    vector_grid->setVectorType(openvdb::VEC_CONTRAVARIANT_RELATIVE);
+    vector_grid->setGridClass(openvdb::GRID_UNKNOWN);
+    ret.push_back(vector_grid);
+
+    if (with_magnitude) {
+        auto magnitude = grids->back();
+
+        name_grid(*magnitude, array, override_name);
+        magnitude->setName(vector_grid->getName() + "_magnitude");
+        ret.push_back(magnitude);
+    }
+
+    return ret;
+}
+
+// Number of builds convert_image makes for the mapped arrays among these
+// attributes: one per vector array, and one for all scalar arrays unless
+// they are built separately
+size_t image_build_count(std::vector<vtkDataSetAttributes*> const& sets,
+                         Config const&                             c) {
+    size_t vectors = 0;
+    size_t scalars = 0;
+
+    for (auto* set : sets) {
+        for (int i = 0; i < set->GetNumberOfArrays(); i++) {
+            auto* array = set->GetArray(i);
+
+            if (!array || !array->GetName()) continue;
+            if (!c.name_map.count(array->GetName())) continue;
+
+            if (array->GetNumberOfComponents() == 3) {
+                vectors++;
+            } else {
+                scalars++;
+            }
+        }
+    }
+
+    if (scalars > 1 && !c.has_flag("--separate_topology")) scalars = 1;
+
+    return vectors + scalars;
+}
+
+// Convert the mapped point data arrays of an image, placed as the box says.
+// The box's dims are taken from the image.
+openvdb::GridPtrVec convert_image(vtkImageData* image,
+                                  Config const& base,
+                                  ImageBox      box = {}) {
     openvdb::GridPtrVec ret;
 
     std::array<size_t, 3> dims;
@@ -188,12 +620,23 @@ openvdb::GridPtrVec convert_image(vtkImageData* image, Config const& config) {
     std::cout << "Converting Image " << dims[0] << " " << dims[1] << " "
               << dims[2] << "\n";
 
+    box.dims = dims;
+
     auto* point_data = image->GetPointData();
 
+    // one reporter over the builds of every array
+    auto const config =
+        with_progress(base,
+                      sampled_points(box, base) *
+                          image_build_count({ point_data }, base));
+
     int num_arrays = point_data->GetNumberOfArrays();
 
     std::cout << "Converting...\n";
 
+    std::vector<vtkDataArray*> arrays;
+    std::vector<std::string>   names;
+
     for (int i = 0; i < num_arrays; i++) {
         auto* array = point_data->GetArray(i);
         if (!array) continue;
@@ -202,7 +645,40 @@ openvdb::GridPtrVec convert_image(vtkImageData* image, Config const& config) {
 
         if (iter == config.name_map.end()) continue;
 
-        auto ptr = write_to_grid(array, iter->second, dims, config);
+        // three component arrays become vector grids of their own
+        if (array->GetNumberOfComponents() == 3) {
+            auto grids =
+                write_to_vector_grid(array, iter->second, box, config);
+            ret.insert(ret.end(), grids.begin(), grids.end());
+            continue;
+        }
+
+        arrays.push_back(array);
+        names.push_back(iter->second);
+    }
+
+    // fields of one image share a topology, so build them in one pass
+    if (arrays.size() > 1 && !config.has_flag("--separate_topology")) {
+        std::vector<ArrayField> fields;
+
+        for (auto* array : arrays) {
+            fields.push_back(describe_array(array, box));
+        }
+
+        auto grids = build_fused(fields, box, config);
+
+        for (size_t f = 0; f < grids.size(); f++) {
+            name_grid(*grids[f], arrays[f], names[f]);
+            grids[f]->insertMeta("shared_topology",
+                                 openvdb::BoolMetadata(true));
+            ret.push_back(grids[f]);
+        }
+
+        return ret;
+    }
+
+    for (size_t i = 0; i < arrays.size(); i++) {
+        auto ptr = write_to_grid(arrays[i], names[i], box, config);
         ret.push_back(ptr);
     }
 
@@ -214,8 +690,13 @@ openvdb::GridPtrVec convert_vti(Config const& config) {
 
     auto reader = vtkSmartPointer<vtkXMLImageDataReader>::New();
 
-    reader->SetFileName(config.input_path.c_str());
-    reader->Update();
+    {
+        PhaseTimer timer(config, "read");
+        timer.add_bytes_read(fs::file_size(config.input_path));
+
+        reader->SetFileName(config.input_path.c_str());
+        reader->Update();
+    }
 
     auto* im = reader->GetOutput();
 
@@ -259,71 +740,244 @@ std::array<int, 3> compute_sample_rate(Config const& config, double bounds[6]) {
     return num_samples;
 }
 
-openvdb::GridPtrVec convert_vtm(Config const& config) {
+// Merge the grids built for each block into one grid per name
+openvdb::GridPtrVec merge_blocks(std::vector<openvdb::GridPtrVec> const& blocks,
+                                 Config const&                           c) {
+    std::vector<std::string>                             names;
+    std::unordered_map<std::string, openvdb::GridPtrVec> parts;
+
+    for (auto const& block : blocks) {
+        for (auto const& grid : block) {
+            auto& list = parts[grid->getName()];
+            if (list.empty()) names.push_back(grid->getName());
+            list.push_back(grid);
+        }
+    }
+
+    std::cout << "Merging " << blocks.size() << " blocks..." << std::endl;
+
+    PhaseTimer timer(c, "merge_blocks");
+
     openvdb::GridPtrVec ret;
 
+    for (auto const& name : names) {
+        auto const& list = parts[name];
+
+        if (list.front()->isType<openvdb::Vec3SGrid>()) {
+            ret.push_back(merge_pairwise<openvdb::Vec3SGrid>(list, c));
+        } else {
+            ret.push_back(merge_pairwise<openvdb::FloatGrid>(list, c));
+        }
+    }
+
+    timer.add_grids(ret);
+
+    return ret;
+}
+
+// Global voxel size for a multiblock. A rate is the voxel size itself; a
+// sample count is the number of voxels along the shortest side.
+double compute_voxel_size(Config const& config, double bounds[6]) {
+    if (config.sample_rate) return *config.sample_rate;
+
+    double min_size = std::min({ bounds[1] - bounds[0],
+                                 bounds[3] - bounds[2],
+                                 bounds[5] - bounds[4] });
+
+    return min_size / config.num_samples.value_or(100);
+}
+
+openvdb::GridPtrVec convert_vtm(Config const& config) {
     auto reader = vtkSmartPointer<vtkXMLMultiBlockDataReader>::New();
 
-    reader->SetFileName(config.input_path.c_str());
-    reader->Update();
+    {
+        PhaseTimer timer(config, "read");
+        timer.add_bytes_read(fs::file_size(config.input_path));
+
+        reader->SetFileName(config.input_path.c_str());
+        reader->Update();
+    }
 
     auto* composite = reader->GetOutput();
 
     auto* mblocks = vtkMultiBlockDataSet::SafeDownCast(composite);
 
-    if (!mblocks) return ret;
+    if (!mblocks) return {};
 
-    double bounds[6];
+    std::vector<vtkDataSet*> blocks;
+
+    double bounds[6] = { VTK_DOUBLE_MAX, VTK_DOUBLE_MIN, VTK_DOUBLE_MAX,
+                         VTK_DOUBLE_MIN, VTK_DOUBLE_MAX, VTK_DOUBLE_MIN };
 
     {
         auto* iter = mblocks->NewIterator();
 
-        while (!iter->IsDoneWithTraversal()) {
+        for (iter->InitTraversal(); !iter->IsDoneWithTraversal();
+             iter->GoToNextItem()) {
 
-            auto* obj = iter->GetCurrentDataObject();
+            auto* obj   = iter->GetCurrentDataObject();
+            auto* block = vtkDataSet::SafeDownCast(obj);
 
-            auto* usgrid = vtkUnstructuredGrid::SafeDownCast(obj);
+            if (!block || block->GetNumberOfPoints() == 0) continue;
 
-            if (usgrid) {
-                usgrid->GetBounds(bounds);
+            double block_bounds[6];
+            block->GetBounds(block_bounds);
 
-                // for now
-                break;
+            for (int i = 0; i < 3; i++) {
+                bounds[2 * i] = std::min(bounds[2 * i], block_bounds[2 * i]);
+                bounds[2 * i + 1] =
+                    std::max(bounds[2 * i + 1], block_bounds[2 * i + 1]);
             }
 
-
-            iter->GoToNextItem();
+            blocks.push_back(block);
         }
 
         iter->Delete();
     }
 
+    if (blocks.empty()) return {};
+
     std::cout << "Bounds " << bounds[0] << " " << bounds[1] << " " << bounds[2]
               << " " << bounds[3] << " " << bounds[4] << " " << bounds[5]
               << "\n";
 
-    std::array<int, 3> num_samples = compute_sample_rate(config, bounds);
+    double const voxel_size = compute_voxel_size(config, bounds);
 
-    std::cout << "Sampling " << num_samples[0] << " " << num_samples[1] << " "
-              << num_samples[2] << "\n";
+    std::cout << "Voxel size " << voxel_size << " over " << blocks.size()
+              << " blocks\n";
+
+    // Each block is sampled on the global lattice, over the lattice points
+    // covering its own bounds, and built at its place in index space.
+    struct BlockLattice {
+        std::array<size_t, 3> offset;
+        std::array<int, 3>    samples;
+        double                sample_bounds[6];
+    };
+
+    std::vector<BlockLattice> lattices(blocks.size());
+
+    uint64_t total_voxels = 0;
+
+    // extent of the lattice in index space
+    std::array<size_t, 3> lattice_dims = { 0, 0, 0 };
+
+    // ranges of the mapped arrays over every block, so that the same values
+    // are left inactive in all of them
+    RangeMap ranges;
+
+    for (size_t b = 0; b < blocks.size(); b++) {
+        double block_bounds[6];
+        blocks[b]->GetBounds(block_bounds);
+
+        auto& l = lattices[b];
+
+        for (int i = 0; i < 3; i++) {
+            double lo = (block_bounds[2 * i] - bounds[2 * i]) / voxel_size;
+            double hi = (block_bounds[2 * i + 1] - bounds[2 * i]) / voxel_size;
+
+            l.offset[i]  = size_t(std::floor(lo));
+            l.samples[i] = int(std::ceil(hi) - l.offset[i]) + 1;
+
+            l.sample_bounds[2 * i] = bounds[2 * i] + l.offset[i] * voxel_size;
+            l.sample_bounds[2 * i + 1] =
+                l.sample_bounds[2 * i] + (l.samples[i] - 1) * voxel_size;
+        }
+
+        // resampling turns cell data into point data
+        std::vector<vtkDataSetAttributes*> sets = { blocks[b]->GetPointData(),
+                                                    blocks[b]->GetCellData() };
+
+        ImageBox box;
+        box.offset = l.offset;
+
+        for (int i = 0; i < 3; i++) {
+            box.dims[i]     = l.samples[i];
+            lattice_dims[i] =
+                std::max(lattice_dims[i], l.offset[i] + box.dims[i]);
+        }
+
+        total_voxels +=
+            sampled_points(box, config) * image_build_count(sets, config);
+
+        for (auto* set : sets) {
+            for (int i = 0; i < set->GetNumberOfArrays(); i++) {
+                auto* array = set->GetArray(i);
+
+                if (!array || !array->GetName()) continue;
+                if (!config.name_map.count(array->GetName())) continue;
+
+                int   component = array->GetNumberOfComponents() == 3 ? -1 : 0;
+                auto* range     = array->GetRange(component);
 
+                auto [iter, added] = ranges.try_emplace(
+                    array->GetName(), std::array { range[0], range[1] });
 
-    for (unsigned block_iter = 0; block_iter < mblocks->GetNumberOfBlocks();
-         block_iter++) {
+                if (!added) {
+                    iter->second[0] = std::min(iter->second[0], range[0]);
+                    iter->second[1] = std::max(iter->second[1], range[1]);
+                }
+            }
+        }
+    }
+
+    // one reporter over the builds of every block
+    auto const block_config = with_progress(config, total_voxels);
+
+    std::vector<openvdb::GridPtrVec> block_grids(blocks.size());
+
+    auto convert_block = [&](size_t b) {
+        auto const& l = lattices[b];
 
         auto sampler = vtkSmartPointer<vtkResampleToImage>::New();
 
-        sampler->SetInputDataObject(mblocks->GetBlock(block_iter));
-        sampler->SetUseInputBounds(true);
+        sampler->SetInputDataObject(blocks[b]);
+        sampler->SetUseInputBounds(false);
+        sampler->SetSamplingBounds(l.sample_bounds);
         sampler->SetSamplingDimensions(
-            num_samples[0], num_samples[1], num_samples[2]);
+            l.samples[0], l.samples[1], l.samples[2]);
+
+        {
+            PhaseTimer timer(config, "resample", PhaseTimer::Clock::THREAD);
+            sampler->Update();
+        }
+
+        auto* image = sampler->GetOutput();
 
+        // lattice points outside the block's cells are not sampled
+        auto* mask =
+            image->GetPointData()->GetArray(sampler->GetMaskArrayName());
 
-        sampler->Update();
+        ImageBox box;
+        box.offset = l.offset;
+        box.ranges = &ranges;
 
-        auto sub_parts = convert_image(sampler->GetOutput(), config);
+        if (mask) box.valid = static_cast<char const*>(mask->GetVoidPointer(0));
 
-        ret.insert(ret.end(), sub_parts.begin(), sub_parts.end());
+        block_grids[b] = convert_image(image, block_config, box);
+    };
+
+    if (config.use_threads) {
+        tbb::parallel_for(size_t(0), blocks.size(), convert_block);
+    } else {
+        for (size_t b = 0; b < blocks.size(); b++) {
+            convert_block(b);
+        }
+    }
+
+    auto ret = merge_blocks(block_grids, config);
+
+    // All blocks share the lattice, so one transform places them in world
+    // space
+    auto transform =
+        openvdb::math::Transform::createLinearTransform(voxel_size);
+    transform->postTranslate(openvdb::Vec3d(bounds[0], bounds[2], bounds[4]));
+
+    auto const sample = sample_box(lattice_dims, config);
+
+    if (!sample.covers(lattice_dims)) sample.place(*transform);
+
+    for (auto& grid : ret) {
+        grid->setTransform(transform);
     }
 
     return ret;
@@ -444,6 +1098,253 @@ std::array<int, 3> find_cell_counts(Config const&      config,
     return ret;
 }
 
+// Size of the cells of each loaded AMR level, in cells of the target level
+std::vector<std::array<int, 3>> level_scales(vtkOverlappingAMR* amr,
+                                             unsigned           target) {
+    double fine[3];
+    amr->GetSpacing(target, fine);
+
+    std::vector<std::array<int, 3>> ret(amr->GetNumberOfLevels());
+
+    for (unsigned level = 0; level < ret.size(); level++) {
+        double spacing[3];
+        amr->GetSpacing(level, spacing);
+
+        for (int i = 0; i < 3; i++) {
+            ret[level][i] = std::max(1, int(std::lround(spacing[i] / fine[i])));
+        }
+    }
+
+    return ret;
+}
+
+// Transform placing the cell centers of a level's index space in world space
+openvdb::math::Transform::Ptr level_transform(vtkOverlappingAMR* amr,
+                                              unsigned           level) {
+    double spacing[3];
+    amr->GetSpacing(level, spacing);
+
+    double const* origin = amr->GetOrigin();
+
+    openvdb::Mat4d m = openvdb::Mat4d::identity();
+    m.preScale(openvdb::Vec3d(spacing[0], spacing[1], spacing[2]));
+    m.postTranslate(openvdb::Vec3d(origin[0] + spacing[0] / 2,
+                                   origin[1] + spacing[1] / 2,
+                                   origin[2] + spacing[2] / 2));
+
+    return openvdb::math::Transform::createLinearTransform(m);
+}
+
+// Write the visible cells of one AMR box into a new grid, each cell filling
+// scale cells of the target level. Cells at or below range_min are left
+// inactive.
+template <class Value>
+openvdb::FloatGrid::Ptr fill_amr_box(vtkUniformGrid*          block,
+                                     vtkAMRBox const&         box,
+                                     std::array<int, 3> const scale,
+                                     double                   range_min,
+                                     Value const&             value,
+                                     Config const&            c) {
+    int dims[3];
+    block->GetCellDims(dims);
+
+    int const* lo = box.GetLoCorner();
+
+    auto reader = [&](size_t x, size_t y, size_t z, float* out) {
+        vtkIdType cell = x + dims[0] * (y + dims[1] * z);
+
+        if (!block->IsCellVisible(cell)) return false;
+
+        double v = value(cell);
+
+        if (!(v > range_min)) return false;
+
+        *out = v;
+        return true;
+    };
+
+    std::array<size_t, 3> const cells = { size_t(dims[0]),
+                                          size_t(dims[1]),
+                                          size_t(dims[2]) };
+
+    return build_box_fields({ lo[0], lo[1], lo[2] }, cells, scale, 1, reader, c)
+        .front();
+}
+
+openvdb::FloatGrid::Ptr convert_amr_box(vtkUniformGrid*          block,
+                                        vtkAMRBox const&         box,
+                                        vtkDataArray*            array,
+                                        std::array<int, 3> const scale,
+                                        double                   range_min,
+                                        Config const&            c) {
+    size_t num_comp = array->GetNumberOfComponents();
+
+    void* raw = array->HasStandardMemoryLayout() ? array->GetVoidPointer(0)
+                                                 : nullptr;
+
+    auto typed = [&](auto tag) {
+        auto const* data = static_cast<decltype(tag) const*>(raw);
+
+        return fill_amr_box(
+            block,
+            box,
+            scale,
+            range_min,
+            [=](vtkIdType cell) { return double(data[cell * num_comp]); },
+            c);
+    };
+
+    if (raw) {
+        auto type = figure_type(array->GetDataType());
+        if (auto grid = dispatch_type(type, typed)) return *grid;
+    }
+
+    return fill_amr_box(
+        block,
+        box,
+        scale,
+        range_min,
+        [=](vtkIdType cell) { return array->GetComponent(cell, 0); },
+        c);
+}
+
+// Convert the cells of an AMR hierarchy at their native resolution, without
+// resampling to a dense image. Boxes are converted in parallel. With
+// --amr_per_level, each level is kept as its own grid with its own
+// transform; memory then follows the cell count of the hierarchy.
+// Otherwise every level is written into the index space of the finest,
+// where a coarse cell fills a block of fine voxels and only becomes a tile
+// when it covers a whole leaf. Wherever a coarse level shows, the merged grid
+// is therefore dense at the finest resolution. Levels are built finest
+// first and each is merged in and freed as soon as it is built, so finer
+// cells take precedence where levels overlap.
+openvdb::GridPtrVec convert_amr_native(vtkOverlappingAMR* amr,
+                                       Config const&      config) {
+    bool const per_level = config.has_flag("--amr_per_level");
+
+    unsigned const levels = amr->GetNumberOfLevels();
+
+    if (levels == 0) return {};
+
+    unsigned const finest = levels - 1;
+
+    auto const scales = level_scales(amr, finest);
+
+    if (!per_level && finest > 0) print_amr_merge_note();
+
+    openvdb::GridPtrVec ret;
+
+    for (auto const& [name, override_name] : config.name_map) {
+        // range over all boxes, so activity matches the resampled path
+        vtkDataArray* first     = nullptr;
+        double        range_min = VTK_DOUBLE_MAX;
+
+        for (unsigned level = 0; level < levels; level++) {
+            for (unsigned i = 0; i < amr->GetNumberOfDataSets(level); i++) {
+                auto* block = amr->GetDataSet(level, i);
+                if (!block) continue;
+
+                auto* array = block->GetCellData()->GetArray(name.c_str());
+                if (!array) continue;
+
+                if (!first) first = array;
+                range_min = std::min(range_min, array->GetRange(0)[0]);
+            }
+        }
+
+        if (!first) continue;
+
+        std::cout << "Working on: " << name << "\n";
+
+        auto build_level = [&](unsigned level) {
+            auto const scale =
+                per_level ? std::array<int, 3> { 1, 1, 1 } : scales[level];
+
+            unsigned const count = amr->GetNumberOfDataSets(level);
+
+            openvdb::GridPtrVec parts(count);
+
+            PhaseTimer timer(config, "build");
+
+            auto convert_block = [&](size_t i) {
+                auto* block = amr->GetDataSet(level, i);
+                if (!block) return;
+
+                auto* array = block->GetCellData()->GetArray(name.c_str());
+                if (!array) return;
+
+                parts[i] = convert_amr_box(block,
+                                           amr->GetAMRBox(level, i),
+                                           array,
+                                           scale,
+                                           range_min,
+                                           config);
+            };
+
+            if (config.use_threads) {
+                tbb::parallel_for(size_t(0), size_t(count), convert_block);
+            } else {
+                for (size_t i = 0; i < count; i++) {
+                    convert_block(i);
+                }
+            }
+
+            parts.erase(std::remove(parts.begin(), parts.end(), nullptr),
+                        parts.end());
+
+            if (timer.enabled()) {
+                for (auto const& part : parts) {
+                    auto grid = openvdb::gridPtrCast<openvdb::FloatGrid>(part);
+                    timer.add_voxels(grid->activeVoxelCount());
+                }
+            }
+
+            if (parts.empty()) {
+                return openvdb::FloatGrid::create(build_background(config));
+            }
+
+            return merge_pairwise<openvdb::FloatGrid>(parts, config);
+        };
+
+        if (per_level) {
+            for (unsigned level = 0; level < levels; level++) {
+                auto grid = build_level(level);
+
+                prune_grid(*grid, config);
+
+                name_grid(*grid, first, override_name);
+                grid->setName(grid->getName() + "_level" +
+                              std::to_string(level));
+                grid->setTransform(level_transform(amr, level));
+                grid->insertMeta("amr_level", openvdb::Int32Metadata(level));
+
+                ret.push_back(grid);
+            }
+
+            continue;
+        }
+
+        auto grid = build_level(finest);
+
+        for (unsigned level = finest; level-- > 0;) {
+            auto coarse = build_level(level);
+
+            PhaseTimer timer(config, "merge_levels");
+
+            grid->tree().merge(coarse->tree(), openvdb::MERGE_ACTIVE_STATES);
+        }
+
+        prune_grid(*grid, config);
+
+        name_grid(*grid, first, override_name);
+        grid->setTransform(level_transform(amr, finest));
+
+        ret.push_back(grid);
+    }
+
+    return ret;
+}
+
 openvdb::GridPtrVec convert_amrex(Config const& config) {
     openvdb::GridPtrVec ret;
 
@@ -466,10 +1367,16 @@ openvdb::GridPtrVec convert_amrex(Config const& config) {
         }
     }
 
-    reader->Update();
+    {
+        PhaseTimer timer(config, "read");
+        reader->Update();
+    }
 
     auto* output = reader->GetOutput();
 
+    if (config.has_flag("--amr_native") || config.has_flag("--amr_per_level")) {
+        return convert_amr_native(output, config);
+    }
 
     std::array<int, 3> extents = find_cell_counts(config, output);
 
@@ -530,8 +1437,7 @@ openvdb::GridPtrVec convert_amrex(Config const& config) {
 
 
 VTKPlugin::VTKPlugin(Config const& config) {
-    auto hwc = config.use_threads ? std::thread::hardware_concurrency() : 1;
-    vtkSMPTools::Initialize(hwc);
+    vtkSMPTools::Initialize(thread_count(config));
 
     std::cout << "VTK Concurrency: "
               << vtkSMPTools::GetEstimatedNumberOfThreads() << "\n";
@@ -539,7 +1445,9 @@ VTKPlugin::VTKPlugin(Config const& config) {
 
 VTKPlugin::~VTKPlugin() { }
 
-bool VTKPlugin::recognized(fs::path const& exts) {
+bool VTKPlugin::recognized(fs::path const& path) {
+    auto exts = path.extension();
+
     if (exts == ".vti") { return true; }
     if (exts == ".vtm") { return true; }
 